@@ -1,38 +1,54 @@
 #!/bin/bash
 
+# --emit-bytecode and --text-stage N (inter-stage format) are handled by
+# scripts/common.sh.
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+source "$SCRIPT_DIR/../scripts/common.sh" "$@"
+set -- "${PIPELINE_ARGS[@]}"
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    *) echo "Usage: $0 [--emit-bytecode] [--text-stage N]..."; exit 1 ;;
+  esac
+  shift
+done
+
 
 echo "Stage 1: Initial canonicalization..."
 mlir-opt alexnet_linalg.mlir \
   --canonicalize \
   --cse \
-  -o step1.mlir
+  $BC_FLAGS \
+  -o step1.$EXT
+materialize_text 1 step1
 
-mlir-opt step1.mlir \
+mlir-opt step1.$EXT \
   --one-shot-bufferize="bufferize-function-boundaries" \
-  -o step2.mlir
-
-mlir-opt step2.mlir \
-  --convert-linalg-to-loops \
-  --convert-scf-to-cf \
-  -o step3.mlir
+  $BC_FLAGS \
+  -o step2.$EXT
+materialize_text 2 step2
 
-mlir-opt step2.mlir \
+mlir-opt step2.$EXT \
   --convert-linalg-to-loops \
   --convert-scf-to-cf \
-  -o step3.mlir
+  $BC_FLAGS \
+  -o step3.$EXT
+materialize_text 3 step3
 
 
-mlir-opt step3.mlir \
+mlir-opt step3.$EXT \
  --lower-affine \
  --expand-strided-metadata \
- --finalize-memref-to-llvm \
+ --finalize-memref-to-llvm="use-generic-functions=1" \
  --convert-arith-to-llvm \
  --convert-func-to-llvm \
  --convert-cf-to-llvm \
  --reconcile-unrealized-casts \
- -o alexnet_llvm_dialect.mlir
+ $BC_FLAGS \
+ -o alexnet_llvm_dialect.$EXT
+materialize_text 4 alexnet_llvm_dialect
 
- mlir-translate --mlir-to-llvmir alexnet_llvm_dialect.mlir > alexnet.ll
+ mlir-translate --mlir-to-llvmir alexnet_llvm_dialect.$EXT > alexnet.ll
 
 llc -filetype=obj -relocation-model=pic alexnet.ll -o alexnet.o
 
@@ -0,0 +1,208 @@
+/* Allocator behind the heap allocations of the generated model.
+ *
+ * The pipelines lower memref.alloc/dealloc with
+ * --finalize-memref-to-llvm="use-generic-functions=1", so alexnet.o calls
+ * _mlir_memref_to_llvm_alloc/_aligned_alloc/_free instead of libc malloc and
+ * free.  They are defined here, once per driver, and forward to one of three
+ * allocators chosen with ALEXNET_ALLOCATOR:
+ *
+ *   libc  malloc/free (default);
+ *   bump  a bump pointer into an arena of ALEXNET_BUMP_MB (default 1024)
+ *         reserved at startup and rewound before every call; free is a no-op;
+ *   pool  power-of-two size classes from 64 bytes, recycled through per-class
+ *         free lists and never returned to libc.
+ *
+ * Every allocation carries a small header, so all modes count allocations,
+ * bytes and peak live bytes between alexnet_alloc_begin() and the next one.
+ * The hooks may be called from OpenMP worker threads. */
+#ifndef ALEXNET_ALLOC_H
+#define ALEXNET_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+enum { ALLOC_LIBC, ALLOC_BUMP, ALLOC_POOL };
+
+#define ALLOC_ALIGN 64
+#define ALLOC_CLASSES 48
+
+typedef struct {
+    void *base;         /* start of the underlying block */
+    uint64_t size;      /* bytes requested by the model */
+    int32_t kind;       /* allocator that owns the block */
+    int32_t size_class; /* pool size class, or -1 */
+} AllocHeader;
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;
+    uint64_t live;
+    uint64_t peak;
+} AllocStats;
+
+static int alloc_mode = -1;
+static AllocStats alloc_stats;
+static char *bump_base, *bump_end, *bump_next;
+static void *pool_free_lists[ALLOC_CLASSES];
+static volatile int pool_lock;
+
+static const char *alloc_mode_name(void) {
+    static const char *names[] = {"libc", "bump", "pool"};
+    return names[alloc_mode < 0 ? ALLOC_LIBC : alloc_mode];
+}
+
+/* Picks the allocator from the environment; runs on the first allocation if
+ * the driver did not call it. */
+static void alexnet_alloc_init(void) {
+    if (alloc_mode >= 0) {
+        return;
+    }
+    const char *mode = getenv("ALEXNET_ALLOCATOR");
+    alloc_mode = ALLOC_LIBC;
+    if (mode && strcmp(mode, "pool") == 0) {
+        alloc_mode = ALLOC_POOL;
+    } else if (mode && strcmp(mode, "bump") == 0) {
+        const char *mb = getenv("ALEXNET_BUMP_MB");
+        size_t size = (size_t)(mb ? atol(mb) : 1024) << 20;
+        /* Reserved, not committed: pages are only touched as the arena fills. */
+        void *arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena == MAP_FAILED) {
+            fprintf(stderr, "Failed to reserve a %zu MB bump arena, using libc\n", size >> 20);
+        } else {
+            bump_base = bump_next = (char *)arena;
+            bump_end = bump_base + size;
+            alloc_mode = ALLOC_BUMP;
+        }
+    } else if (mode && strcmp(mode, "libc") != 0) {
+        fprintf(stderr, "Unknown ALEXNET_ALLOCATOR '%s', using libc\n", mode);
+    }
+}
+
+/* Starts a new inference: clears the counters and rewinds the bump arena. */
+static void alexnet_alloc_begin(void) {
+    alexnet_alloc_init();
+    memset(&alloc_stats, 0, sizeof(alloc_stats));
+    bump_next = bump_base;
+}
+
+static AllocStats alexnet_alloc_stats(void) {
+    return alloc_stats;
+}
+
+static void alloc_count(uint64_t size) {
+    __atomic_add_fetch(&alloc_stats.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_stats.bytes, size, __ATOMIC_RELAXED);
+    uint64_t live = __atomic_add_fetch(&alloc_stats.live, size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&alloc_stats.peak, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&alloc_stats.peak, &peak, live, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static int pool_class(size_t size) {
+    int c = 0;
+    while (c < ALLOC_CLASSES - 1 && ((size_t)ALLOC_ALIGN << c) < size) {
+        c++;
+    }
+    return ((size_t)ALLOC_ALIGN << c) < size ? -1 : c;
+}
+
+/* Block of `total` bytes from the selected allocator; sets kind and class. */
+static void *alloc_block(size_t total, size_t align, int32_t *kind, int32_t *size_class) {
+    *kind = alloc_mode;
+    *size_class = -1;
+    if (alloc_mode == ALLOC_BUMP) {
+        char *next = __atomic_load_n(&bump_next, __ATOMIC_RELAXED);
+        for (;;) {
+            char *start = (char *)(((uintptr_t)next + align - 1) & ~(uintptr_t)(align - 1));
+            if (start + total > bump_end) {
+                break; /* arena full: fall back to libc */
+            }
+            if (__atomic_compare_exchange_n(&bump_next, &next, start + total, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return start;
+            }
+        }
+    } else if (alloc_mode == ALLOC_POOL && align <= ALLOC_ALIGN) {
+        int c = pool_class(total);
+        if (c >= 0) {
+            *size_class = c;
+            while (__atomic_exchange_n(&pool_lock, 1, __ATOMIC_ACQUIRE)) {
+            }
+            void *block = pool_free_lists[c];
+            if (block) {
+                pool_free_lists[c] = *(void **)block;
+            }
+            __atomic_store_n(&pool_lock, 0, __ATOMIC_RELEASE);
+            if (block) {
+                return block;
+            }
+            total = (size_t)ALLOC_ALIGN << c;
+        }
+    }
+    if (*size_class < 0) {
+        *kind = ALLOC_LIBC;
+    }
+    void *block = NULL;
+    return posix_memalign(&block, align, total) == 0 ? block : NULL;
+}
+
+static void *alloc_aligned(size_t align, size_t size) {
+    alexnet_alloc_init();
+    if (align < ALLOC_ALIGN) {
+        align = ALLOC_ALIGN;
+    }
+    /* The header sits in the `align` bytes in front of the returned pointer. */
+    int32_t kind, size_class;
+    char *base = (char *)alloc_block(align + size, align, &kind, &size_class);
+    if (base == NULL) {
+        return NULL;
+    }
+    AllocHeader *h = (AllocHeader *)(base + align) - 1;
+    h->base = base;
+    h->size = size;
+    h->kind = kind;
+    h->size_class = size_class;
+    alloc_count(size);
+    return base + align;
+}
+
+void *_mlir_memref_to_llvm_alloc(size_t size) {
+    return alloc_aligned(ALLOC_ALIGN, size);
+}
+
+void *_mlir_memref_to_llvm_aligned_alloc(size_t align, size_t size) {
+    return alloc_aligned(align, size);
+}
+
+void _mlir_memref_to_llvm_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    AllocHeader *h = (AllocHeader *)ptr - 1;
+    __atomic_add_fetch(&alloc_stats.frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&alloc_stats.live, h->size, __ATOMIC_RELAXED);
+    if (h->kind == ALLOC_BUMP) {
+        return;
+    }
+    if (h->kind == ALLOC_POOL) {
+        void *block = h->base;
+        int c = h->size_class;
+        while (__atomic_exchange_n(&pool_lock, 1, __ATOMIC_ACQUIRE)) {
+        }
+        *(void **)block = pool_free_lists[c];
+        pool_free_lists[c] = block;
+        __atomic_store_n(&pool_lock, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    free(h->base);
+}
+
+#endif /* ALEXNET_ALLOC_H */
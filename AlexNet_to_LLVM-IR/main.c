@@ -2,6 +2,8 @@
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image.h"
 #include "stb_image_resize2.h"
+#include "alexnet_alloc.h"
+#include "alexnet_copy.h"
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,8 +26,6 @@
 
 extern void alexnet(float**, float**);
 
-void memrefCopy(void) { }
-
 static char* imagenet_classes[1000];
 static int classes_loaded = 0;
 
@@ -319,11 +319,20 @@ int main(int argc, char **argv) {
     }
 
     printf("You can chill again.... Inferencing is progress!!!!!!\n");
+    alexnet_alloc_begin();
+    alexnet_copy_begin();
 double start_time  = clock();
     alexnet(&out_buf, &in_buf);
 double end_time  = clock();
 double time_taken = (end_time - start_time) / CLOCKS_PER_SEC;
 printf("Time taken for inference: %f seconds\n", time_taken);
+    AllocStats alloc = alexnet_alloc_stats();
+    printf("Allocations (%s): %llu, %.2f MB, peak live %.2f MB\n", alloc_mode_name(),
+           (unsigned long long)alloc.allocs, alloc.bytes / (1024.0 * 1024.0),
+           alloc.peak / (1024.0 * 1024.0));
+    CopyStats copies = alexnet_copy_stats();
+    printf("memrefCopy: %llu calls, %.2f MB\n", (unsigned long long)copies.calls,
+           copies.bytes / (1024.0 * 1024.0));
 
     printf("\nBreak over. Run another test........Inference completed!!!!!\n\n");
 
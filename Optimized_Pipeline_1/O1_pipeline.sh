@@ -1,113 +1,215 @@
 #!/bin/bash
 
+# --emit-bytecode and --text-stage N (inter-stage format) are handled by
+# scripts/common.sh.
+# --affine lowers linalg to affine.for instead of scf.for in Stage 5, so the
+# affine passes of Stage 6 see affine loops; affine is then lowered in Stage 8
+# ahead of the SCF to CF conversion.  --parallel lowers linalg to scf.parallel
+# and then to OpenMP; link with clang -fopenmp and pick the thread count with
+# the fourth argument of the driver (or OMP_NUM_THREADS).
+# --external-weights embed|mmap moves the weights out of the IR before Stage 1
+# (tools/weights.py externalize); the LLVM IR then only declares them.  They
+# are linked in from alexnet_weights.o, either embedded with .incbin (embed)
+# or mapped from alexnet_weights.bin by the driver at startup (mmap).
+# --isa-variants sse4.2,avx2,avx512 (or all) replaces -mcpu=native in Stages
+# 13-14: the IR is compiled once per ISA level and alexnet.o picks the variant
+# for the running CPU at load time (tools/isa.py).
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+source "$SCRIPT_DIR/../scripts/common.sh" "$@"
+set -- "${PIPELINE_ARGS[@]}"
+
+AFFINE=0
+PARALLEL=0
+EXTERNAL_WEIGHTS=""
+ISA_VARIANTS=""
+while [ $# -gt 0 ]; do
+  case "$1" in
+    --affine) AFFINE=1 ;;
+    --parallel) PARALLEL=1 ;;
+    --external-weights) EXTERNAL_WEIGHTS="$2"; shift ;;
+    --isa-variants) ISA_VARIANTS="$2"; shift ;;
+    *) echo "Usage: $0 [--emit-bytecode] [--text-stage N]... [--affine | --parallel] [--external-weights embed|mmap] [--isa-variants LIST]"; exit 1 ;;
+  esac
+  shift
+done
+
+LINALG_TO_LOOPS="--convert-linalg-to-loops"
+EARLY_LOWER_AFFINE=""
+if [ "$AFFINE" = 1 ]; then
+  LINALG_TO_LOOPS="--convert-linalg-to-affine-loops"
+  EARLY_LOWER_AFFINE="--lower-affine"
+fi
+SCF_TO_OPENMP=""
+OPENMP_TO_LLVM=""
+if [ "$PARALLEL" = 1 ]; then
+  if [ "$AFFINE" = 1 ]; then
+    echo "--affine and --parallel are exclusive"; exit 1
+  fi
+  LINALG_TO_LOOPS="--convert-linalg-to-parallel-loops"
+  SCF_TO_OPENMP="--convert-scf-to-openmp"
+  OPENMP_TO_LLVM="--convert-openmp-to-llvm"
+fi
+
+INPUT=alexnet_linalg.mlir
+WEIGHTS_ASM=""
+case "$EXTERNAL_WEIGHTS" in
+  "") ;;
+  embed) WEIGHTS_ASM=alexnet_weights_embed.s ;;
+  mmap) WEIGHTS_ASM=alexnet_weights.s ;;
+  *) echo "--external-weights takes embed or mmap"; exit 1 ;;
+esac
+if [ -n "$WEIGHTS_ASM" ]; then
+  if [ ! alexnet_linalg_ext.mlir -nt alexnet_linalg.mlir ]; then
+    echo "Moving the weights to alexnet_weights.bin..."
+    python3 "$SCRIPT_DIR/../tools/weights.py" externalize -i alexnet_linalg.mlir \
+      -o alexnet_linalg_ext.mlir --blob alexnet_weights.bin || exit 1
+  fi
+  INPUT=alexnet_linalg_ext.mlir
+fi
+
 # Stage 1: Initial cleanup and canonicalization
 echo "Stage 1: Canonicalization and CSE..."
-mlir-opt alexnet_linalg.mlir \
+mlir-opt "$INPUT" \
   --canonicalize \
   --cse \
-  -o step1_canon.mlir
+  $BC_FLAGS \
+  -o step1_canon.$EXT
+materialize_text 1 step1_canon
 
 # Stage 2: High-level Linalg optimizations
 echo "Stage 2: Linalg optimizations..."
-mlir-opt step1_canon.mlir \
+mlir-opt step1_canon.$EXT \
   --linalg-fuse-elementwise-ops \
   --linalg-fold-unit-extent-dims \
   --canonicalize \
   --cse \
-  -o step2_linalg_opt.mlir
+  $BC_FLAGS \
+  -o step2_linalg_opt.$EXT
+materialize_text 2 step2_linalg_opt
 
 # Stage 3: Vectorization preparation and tiling
 echo "Stage 3: Tiling and vectorization prep..."
-mlir-opt step2_linalg_opt.mlir \
+mlir-opt step2_linalg_opt.$EXT \
   --linalg-generalize-named-ops \
   --linalg-fuse-elementwise-ops \
   --canonicalize \
-  -o step3_generalized.mlir
+  $BC_FLAGS \
+  -o step3_generalized.$EXT
+materialize_text 3 step3_generalized
 
 
 # Stage 4: Bufferization
 echo "Stage 4: Bufferization..."
-mlir-opt step3_generalized.mlir \
+mlir-opt step3_generalized.$EXT \
   --one-shot-bufferize="bufferize-function-boundaries function-boundary-type-conversion=identity-layout-map" \
+  --buffer-results-to-out-params="hoist-static-allocs" \
   --canonicalize \
-  -o step4_bufferized.mlir
+  $BC_FLAGS \
+  -o step4_bufferized.$EXT
+materialize_text 4 step4_bufferized
 
 # Stage 4b: Lower deallocations 
 echo "Stage 4b: Lower deallocations..."
-mlir-opt step4_bufferized.mlir \
+mlir-opt step4_bufferized.$EXT \
   --buffer-deallocation-pipeline \
   --canonicalize \
-  -o step4_dealloc.mlir
+  $BC_FLAGS \
+  -o step4_dealloc.$EXT
+materialize_text 4b step4_dealloc
 
 # Stage 5: Convert linalg to loops with optimizations
 echo "Stage 5: Convert linalg to loops..."
-mlir-opt step4_dealloc.mlir \
-  --convert-linalg-to-loops \
+mlir-opt step4_dealloc.$EXT \
+  $LINALG_TO_LOOPS \
   --canonicalize \
   --cse \
-  -o step5_loops.mlir
+  $BC_FLAGS \
+  -o step5_loops.$EXT
+materialize_text 5 step5_loops
 
 # Stage 6: Loop optimizations 
 echo "Stage 6: Loop optimizations..."
-mlir-opt step5_loops.mlir \
+mlir-opt step5_loops.$EXT \
   --loop-invariant-code-motion \
   --affine-loop-fusion \
   --affine-loop-tile="tile-sizes=32 tile-sizes=32" \
   --canonicalize \
-  -o step6_loop_opt.mlir
+  $BC_FLAGS \
+  -o step6_loop_opt.$EXT
+materialize_text 6 step6_loop_opt
 
 # Stage 7: SCF optimizations
 echo "Stage 7: SCF optimizations..."
-mlir-opt step6_loop_opt.mlir \
+mlir-opt step6_loop_opt.$EXT \
   --scf-for-loop-peeling \
   --scf-for-loop-canonicalization \
   --canonicalize \
-  -o step7_scf_opt.mlir
+  $BC_FLAGS \
+  -o step7_scf_opt.$EXT
+materialize_text 7 step7_scf_opt
 
 # Stage 8: Convert SCF to CF
 echo "Stage 8: Convert SCF to CF..."
-mlir-opt step7_scf_opt.mlir \
+mlir-opt step7_scf_opt.$EXT \
+  $EARLY_LOWER_AFFINE \
+  $SCF_TO_OPENMP \
   --convert-scf-to-cf \
   --canonicalize \
-  -o step8_cf.mlir
+  $BC_FLAGS \
+  -o step8_cf.$EXT
+materialize_text 8 step8_cf
 
 # Stage 9: Affine and memref optimizations
 echo "Stage 9: Affine and memref optimizations..."
-mlir-opt step8_cf.mlir \
+mlir-opt step8_cf.$EXT \
   --lower-affine \
   --normalize-memrefs \
   --memref-expand \
   --fold-memref-alias-ops \
   --canonicalize \
-  -o step9_affine_lowered.mlir
+  $BC_FLAGS \
+  -o step9_affine_lowered.$EXT
+materialize_text 9 step9_affine_lowered
 
 # Stage 10: Arithmetic optimizations
 echo "Stage 10: Arithmetic optimizations..."
-mlir-opt step9_affine_lowered.mlir \
+mlir-opt step9_affine_lowered.$EXT \
   --arith-expand \
   --canonicalize \
   --cse \
-  -o step10_arith_opt.mlir
+  $BC_FLAGS \
+  -o step10_arith_opt.$EXT
+materialize_text 10 step10_arith_opt
 
 # Stage 11: Final lowering to LLVM dialect
 echo "Stage 11: Lower to LLVM dialect..."
-mlir-opt step10_arith_opt.mlir \
+mlir-opt step10_arith_opt.$EXT \
   --lower-affine \
   --expand-strided-metadata \
-  --finalize-memref-to-llvm \
+  --finalize-memref-to-llvm="use-generic-functions=1" \
   --lower-affine \
   --convert-arith-to-llvm \
   --convert-cf-to-llvm \
   --convert-func-to-llvm="use-bare-ptr-memref-call-conv=1" \
+  $OPENMP_TO_LLVM \
   --reconcile-unrealized-casts \
   --canonicalize \
-  -o step11_llvm_dialect.mlir
+  $BC_FLAGS \
+  -o step11_llvm_dialect.$EXT
+materialize_text 11 step11_llvm_dialect
 
 
 # Stage 12: Translate to LLVM IR
 echo "Stage 12: Translate to LLVM IR..."
-mlir-translate --mlir-to-llvmir step11_llvm_dialect.mlir > alexnet.ll
-
+mlir-translate --mlir-to-llvmir step11_llvm_dialect.$EXT > alexnet.ll
+
+if [ -n "$ISA_VARIANTS" ]; then
+  # Stages 13-14 once per ISA level, behind a load-time CPU dispatcher.
+  echo "Stages 13-14: one variant per ISA level ($ISA_VARIANTS)..."
+  python3 "$SCRIPT_DIR/../tools/isa.py" build -i alexnet.ll \
+    --opt-passes "loop-vectorize,slp-vectorizer,load-store-vectorizer" \
+    --llc-flags "-O3 -march=x86-64" --variants "$ISA_VARIANTS" -o alexnet.o || exit 1
+else
 # Stage 13: LLVM optimizations
 #ensure that the opt, and llc are of the same version.  
 echo "Stage 13: LLVM optimization passes..."
@@ -125,5 +227,10 @@ llc -O3 \
 
 # Optional: Create object file
 llc -O3 -march=x86-64 -mcpu=native -filetype=obj alexnet_opt.bc -o alexnet.o
+fi
+if [ -n "$WEIGHTS_ASM" ]; then
+  clang -c $WEIGHTS_ASM -o alexnet_weights.o
+  echo "Weights ($EXTERNAL_WEIGHTS): add alexnet_weights.o after alexnet.o when linking"
+fi
 echo "Use this command to run the code: clang -march=native main.c alexnet.o    -lmlir_c_runner_utils     -lmlir_runner_utils -no-pie     -lm     -o alexnet_infer -O3"
 echo "Compilation complete!"
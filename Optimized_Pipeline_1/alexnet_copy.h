@@ -0,0 +1,151 @@
+/* memrefCopy, the runtime function memref.copy lowers to when the copy is not
+ * provably contiguous (--finalize-memref-to-llvm emits a plain memcpy
+ * otherwise).  Same ABI as mlir_c_runner_utils, which this definition takes
+ * precedence over:
+ *
+ *   void memrefCopy(int64_t elem_size, UnrankedMemRef *src, UnrankedMemRef *dst);
+ *
+ * where each ranked descriptor is {allocated, aligned, offset, sizes[rank],
+ * strides[rank]}.  Copies where both sides are contiguous are one block
+ * copy, copies whose innermost dimension is contiguous are one block copy per
+ * row, and anything else goes element by element.  Block copies use AVX2 when
+ * the CPU has it.  Calls and bytes are counted between alexnet_copy_begin()
+ * calls, so the drivers can report the copies an ordering failed to remove. */
+#ifndef ALEXNET_COPY_H
+#define ALEXNET_COPY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+typedef struct {
+    int64_t rank;
+    void *descriptor;
+} UnrankedMemRef;
+
+typedef struct {
+    char *allocated;
+    char *aligned;
+    int64_t offset;
+    int64_t shape[];  /* sizes[rank], then strides[rank] */
+} MemRefDescriptor;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+} CopyStats;
+
+static CopyStats copy_stats;
+
+static void alexnet_copy_begin(void) {
+    memset(&copy_stats, 0, sizeof(copy_stats));
+}
+
+static CopyStats alexnet_copy_stats(void) {
+    return copy_stats;
+}
+
+__attribute__((target("avx2")))
+static void copy_block_avx2(char *dst, const char *src, int64_t n) {
+    int64_t i = 0;
+    for (; i + 128 <= n; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), b);
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), c);
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), d);
+    }
+    for (; i + 32 <= n; i += 32) {
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    if (i < n) {
+        memcpy(dst + i, src + i, (size_t)(n - i));
+    }
+}
+
+static void copy_block(char *dst, const char *src, int64_t n) {
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    if (has_avx2 && n >= 32) {
+        copy_block_avx2(dst, src, n);
+    } else {
+        memcpy(dst, src, (size_t)n);
+    }
+}
+
+/* Whether the dimensions from `dim` inwards are laid out densely. */
+static int is_dense_from(int64_t rank, const int64_t *sizes, const int64_t *strides, int dim) {
+    int64_t expected = 1;
+    for (int d = (int)rank - 1; d >= dim; d--) {
+        if (sizes[d] != 1 && strides[d] != expected) {
+            return 0;
+        }
+        expected *= sizes[d];
+    }
+    return 1;
+}
+
+void memrefCopy(int64_t elem_size, UnrankedMemRef *src_arg, UnrankedMemRef *dst_arg) {
+    int64_t rank = src_arg->rank;
+    MemRefDescriptor *src = (MemRefDescriptor *)src_arg->descriptor;
+    MemRefDescriptor *dst = (MemRefDescriptor *)dst_arg->descriptor;
+    const int64_t *sizes = src->shape;
+    const int64_t *src_strides = src->shape + rank;
+    const int64_t *dst_strides = dst->shape + rank;
+    const char *src_ptr = src->aligned + src->offset * elem_size;
+    char *dst_ptr = dst->aligned + dst->offset * elem_size;
+
+    int64_t count = 1;
+    for (int64_t d = 0; d < rank; d++) {
+        count *= sizes[d];
+    }
+    __atomic_add_fetch(&copy_stats.calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&copy_stats.bytes, (uint64_t)(count * elem_size), __ATOMIC_RELAXED);
+    if (count == 0) {
+        return;
+    }
+    if (rank == 0 || (is_dense_from(rank, sizes, src_strides, 0) &&
+                      is_dense_from(rank, sizes, dst_strides, 0))) {
+        copy_block(dst_ptr, src_ptr, count * elem_size);
+        return;
+    }
+
+    /* Walk the outer dimensions with an index vector; the innermost one is a
+     * block copy if both sides are contiguous there, element by element if not. */
+    int inner_dense = src_strides[rank - 1] == 1 && dst_strides[rank - 1] == 1;
+    int64_t inner = sizes[rank - 1];
+    int64_t index[rank];
+    memset(index, 0, sizeof(index));
+    for (;;) {
+        if (inner_dense) {
+            copy_block(dst_ptr, src_ptr, inner * elem_size);
+        } else {
+            for (int64_t i = 0; i < inner; i++) {
+                memcpy(dst_ptr + i * dst_strides[rank - 1] * elem_size,
+                       src_ptr + i * src_strides[rank - 1] * elem_size, (size_t)elem_size);
+            }
+        }
+        int64_t d = rank - 2;
+        for (; d >= 0; d--) {
+            src_ptr += src_strides[d] * elem_size;
+            dst_ptr += dst_strides[d] * elem_size;
+            if (++index[d] < sizes[d]) {
+                break;
+            }
+            src_ptr -= sizes[d] * src_strides[d] * elem_size;
+            dst_ptr -= sizes[d] * dst_strides[d] * elem_size;
+            index[d] = 0;
+        }
+        if (d < 0) {
+            return;
+        }
+    }
+}
+
+#endif /* ALEXNET_COPY_H */
@@ -7,10 +7,21 @@
 #include <time.h>
 #include <math.h>
 #include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "stb_image.h"
 #include "stb_image_resize2.h"
+#include "alexnet_alloc.h"
+#include "alexnet_copy.h"
 
+/* Batch of the exported model (model.py --batch N): build with -DBATCH=N.
+ * A model exported with --dynamic-batch takes its batch at run time instead;
+ * build with -DALEXNET_DYNAMIC_BATCH. */
+#ifndef BATCH
 #define BATCH 1
+#endif
 #define IN_C 3
 #define IN_H 224  
 #define IN_W 224
@@ -23,17 +34,107 @@
 #define IMAGENET_STD_G  0.224f
 #define IMAGENET_STD_B  0.225f
 
-typedef struct {
-    float *allocated;
-    float *aligned;
-    int64_t offset;
-    int64_t sizes[4];
-    int64_t strides[4];
-} MemRef4D;
+/* Destination-passing entry point: the pipelines turn the returned logits into
+ * an out-parameter (--buffer-results-to-out-params) and pass memrefs as bare
+ * pointers, so the model writes BATCH x NUM_CLASSES floats into `logits` and
+ * allocates nothing for its result.  Both buffers are owned by the caller.
+ *
+ * Bare pointers need static shapes.  A dynamic-batch model is compiled with
+ * phase_driver.py --dynamic-batch, which keeps the default calling convention:
+ * each memref is passed as its expanded descriptor (allocated, aligned,
+ * offset, sizes, strides). */
+#ifdef ALEXNET_DYNAMIC_BATCH
+extern void alexnet(const float *in_allocated, const float *in_aligned, int64_t in_offset,
+                    int64_t in_n, int64_t in_c, int64_t in_h, int64_t in_w,
+                    int64_t in_sn, int64_t in_sc, int64_t in_sh, int64_t in_sw,
+                    float *out_allocated, float *out_aligned, int64_t out_offset,
+                    int64_t out_n, int64_t out_k, int64_t out_sn, int64_t out_sk);
+
+static void run_model(const float *input, float *logits, int batch) {
+    alexnet(input, input, 0, batch, IN_C, IN_H, IN_W,
+            (int64_t)IN_C * IN_H * IN_W, (int64_t)IN_H * IN_W, IN_W, 1,
+            logits, logits, 0, batch, NUM_CLASSES, NUM_CLASSES, 1);
+}
+#else
+extern void alexnet(const float *input, float *logits);
 
-extern void* alexnet(MemRef4D* input);
+static void run_model(const float *input, float *logits, int batch) {
+    (void)batch;
+    alexnet(input, logits);
+}
+#endif
+
+/* Weights moved out of the IR by tools/weights.py externalize.  The model
+ * reads them from `alexnet_weights`, a page-aligned .bss block defined by the
+ * generated alexnet_weights.s; the weight file is mapped over that block at
+ * startup.  Builds with the weights compiled in do not define these. */
+extern char alexnet_weights[] __attribute__((weak));
+extern const uint64_t alexnet_weights_size __attribute__((weak));
+extern const char alexnet_weights_reserved __attribute__((weak));
+
+/* Activation arena of a model compiled with --plan-memory=external
+ * (tools/memory_plan.py): build with -DALEXNET_ARENA_BYTES=<arena bytes>.
+ * A planned model keeps its activations in this one arena (or in its own
+ * .bss copy), so alexnet() must not be called from two threads at once. */
+#ifdef ALEXNET_ARENA_BYTES
+char alexnet_arena[ALEXNET_ARENA_BYTES] __attribute__((aligned(64)));
+#endif
+
+/* "NHWC" in a model compiled with --layout nhwc (tools/layout.py), which
+ * takes its input channels-last; absent otherwise, for NCHW input. */
+extern const char alexnet_input_layout[4] __attribute__((weak));
+
+/* Name of the variant the load-time CPU dispatch picked, in a model built with
+ * --isa-variants (tools/isa.py); absent in single-ISA builds. */
+extern const char *alexnet_isa(void) __attribute__((weak));
+
+static int input_is_nhwc(void) {
+    const char *layout = alexnet_input_layout;
+    return layout != NULL && memcmp(layout, "NHWC", 4) == 0;
+}
 
-void memrefCopy(void) { }
+/* Path from ALEXNET_WEIGHTS (default alexnet_weights.bin).  ALEXNET_MAP_POPULATE
+ * pre-faults the whole file, ALEXNET_HUGEPAGES asks for transparent huge pages. */
+static int map_weights(void) {
+    if (&alexnet_weights_reserved == NULL) {
+        return 0;
+    }
+    const char *path = getenv("ALEXNET_WEIGHTS");
+    if (path == NULL) {
+        path = "alexnet_weights.bin";
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open weights '%s'\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != alexnet_weights_size) {
+        fprintf(stderr, "Weights '%s' do not match the model (%llu bytes expected)\n",
+                path, (unsigned long long)alexnet_weights_size);
+        close(fd);
+        return -1;
+    }
+    int flags = MAP_PRIVATE | MAP_FIXED;
+#ifdef MAP_POPULATE
+    if (getenv("ALEXNET_MAP_POPULATE")) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void *mapped = mmap(alexnet_weights, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("mmap weights");
+        return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    if (getenv("ALEXNET_HUGEPAGES")) {
+        madvise(mapped, (size_t)st.st_size, MADV_HUGEPAGE);
+    }
+#endif
+    printf("Weights: %s (%.1f MB, mapped)\n", path, st.st_size / (1024.0 * 1024.0));
+    return 0;
+}
 
 static char* imagenet_classes[1000];
 static int classes_loaded = 0;
@@ -115,6 +216,10 @@ static int load_and_preprocess_image(const char *filepath, float *buffer) {
     }
 
     const int total_pixels = IN_H * IN_W;
+    /* Element i of channel c lives at c * plane + i * step. */
+    const int nhwc = input_is_nhwc();
+    const int plane = nhwc ? 1 : total_pixels;
+    const int step = nhwc ? 3 : 1;
 
     {
 
@@ -125,7 +230,7 @@ static int load_and_preprocess_image(const char *filepath, float *buffer) {
             unsigned char r = img_to_use[pixel_idx + 0];
             float r_norm = r / 255.0f;
             float r_final = (r_norm - IMAGENET_MEAN_R) / IMAGENET_STD_R;
-            buffer[i] = r_final;
+            buffer[i * step] = r_final;
         }
 
         for (int i = 0; i < total_pixels; i++) {
@@ -135,7 +240,7 @@ static int load_and_preprocess_image(const char *filepath, float *buffer) {
             unsigned char g = img_to_use[pixel_idx + 1];
             float g_norm = g / 255.0f;
             float g_final = (g_norm - IMAGENET_MEAN_G) / IMAGENET_STD_G;
-            buffer[total_pixels + i] = g_final;
+            buffer[plane + i * step] = g_final;
         }
 
         for (int i = 0; i < total_pixels; i++) {
@@ -145,7 +250,7 @@ static int load_and_preprocess_image(const char *filepath, float *buffer) {
             unsigned char b = img_to_use[pixel_idx + 2];
             float b_norm = b / 255.0f;
             float b_final = (b_norm - IMAGENET_MEAN_B) / IMAGENET_STD_B;
-            buffer[2 * total_pixels + i] = b_final;
+            buffer[2 * plane + i * step] = b_final;
         }
     }
 
@@ -154,6 +259,66 @@ static int load_and_preprocess_image(const char *filepath, float *buffer) {
     return 0;
 }
 
+/* argv[1]: one image, a comma-separated list, or @FILE with one path per
+ * line.  Returns the number of paths (stored in *paths), or -1. */
+static int read_image_list(const char *arg, char ***paths) {
+    char *text = NULL;
+    if (arg[0] == '@') {
+        FILE *f = fopen(arg + 1, "r");
+        if (!f) {
+            fprintf(stderr, "Failed to open image list '%s'\n", arg + 1);
+            return -1;
+        }
+        size_t cap = 0, len = 0;
+        int c;
+        while ((c = fgetc(f)) != EOF) {
+            if (len + 1 >= cap) {
+                cap = cap ? 2 * cap : 4096;
+                text = (char*)realloc(text, cap);
+            }
+            text[len++] = (c == '\n' || c == '\r') ? ',' : (char)c;
+        }
+        fclose(f);
+        if (text == NULL) {
+            fprintf(stderr, "Image list '%s' is empty\n", arg + 1);
+            return -1;
+        }
+        text[len] = 0;
+    } else {
+        text = strdup(arg);
+    }
+
+    int count = 0;
+    *paths = NULL;
+    for (char *tok = strtok(text, ","); tok; tok = strtok(NULL, ",")) {
+        if (*tok == 0) continue;
+        *paths = (char**)realloc(*paths, sizeof(char*) * (count + 1));
+        (*paths)[count++] = strdup(tok);
+    }
+    free(text);
+    if (count == 0) {
+        fprintf(stderr, "No images in '%s'\n", arg);
+        return -1;
+    }
+    return count;
+}
+
+/* Fills `batch` input slots from the images; a shorter list is repeated. */
+static int load_batch(char **paths, int count, int batch, float *buffer) {
+    const size_t image_elems = (size_t)IN_C * IN_H * IN_W;
+    for (int b = 0; b < batch; b++) {
+        if (b < count) {
+            if (load_and_preprocess_image(paths[b], buffer + b * image_elems) != 0) {
+                return -1;
+            }
+        } else {
+            memcpy(buffer + b * image_elems, buffer + (b % count) * image_elems,
+                   sizeof(float) * image_elems);
+        }
+    }
+    return 0;
+}
+
 static void softmax(float *logits, float *probs, int num_classes) {
 
     float max_logit = logits[0];
@@ -260,99 +425,133 @@ static void get_topk(float *probs, int num_classes, int k, int *indices, float *
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <image_path> [num_warmup_runs] [num_benchmark_runs]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <image_path[,image_path...]|@list> [num_warmup_runs] [num_benchmark_runs] [num_threads]\n", argv[0]);
         return 1;
     }
 
-    const char *image_path = argv[1];
+    char **image_paths = NULL;
+    int num_images = read_image_list(argv[1], &image_paths);
+    if (num_images < 0) {
+        return 1;
+    }
     int num_warmup = (argc > 2) ? atoi(argv[2]) : 3;
     int num_benchmark = (argc > 3) ? atoi(argv[3]) : 10;
+    /* Threads for the OpenMP variants (--parallel); defaults to OMP_NUM_THREADS. */
+    if (argc > 4 && atoi(argv[4]) > 0) {
+        omp_set_num_threads(atoi(argv[4]));
+    }
+
+    /* A static-batch model always runs BATCH images; a dynamic one runs one
+     * per listed image, or ALEXNET_BATCH. */
+    int batch = BATCH;
+#ifdef ALEXNET_DYNAMIC_BATCH
+    batch = num_images;
+    if (getenv("ALEXNET_BATCH") && atoi(getenv("ALEXNET_BATCH")) > 0) {
+        batch = atoi(getenv("ALEXNET_BATCH"));
+    }
+#endif
+    if (num_images > batch) {
+        fprintf(stderr, "Warning: %d images for a batch of %d, using the first %d\n",
+                num_images, batch, batch);
+    }
 
+    if (map_weights() != 0) {
+        return 1;
+    }
 
     load_imagenet_classes("../imagenet_classes.txt");
 
-    size_t input_elems = (size_t)BATCH * IN_C * IN_H * IN_W;
+    size_t input_elems = (size_t)batch * IN_C * IN_H * IN_W;
+    size_t output_elems = (size_t)batch * NUM_CLASSES;
 
     float *in_buf = NULL;
+    float *out_buf = NULL;
     if (posix_memalign((void**)&in_buf, 64, sizeof(float) * input_elems) != 0) {
         fprintf(stderr, "Failed to allocate input buffer\n");
         cleanup_classes();
         return 1;
     }
+    /* Allocated once and reused by every call. */
+    if (posix_memalign((void**)&out_buf, 64, sizeof(float) * output_elems) != 0) {
+        fprintf(stderr, "Failed to allocate output buffer\n");
+        free(in_buf);
+        cleanup_classes();
+        return 1;
+    }
+    memset(out_buf, 0, sizeof(float) * output_elems);
 
-    MemRef4D input_desc;
-    input_desc.allocated = in_buf;
-    input_desc.aligned = in_buf;
-    input_desc.offset = 0;
-    input_desc.sizes[0] = BATCH;
-    input_desc.sizes[1] = IN_C;
-    input_desc.sizes[2] = IN_H;
-    input_desc.sizes[3] = IN_W;
-    input_desc.strides[0] = IN_C * IN_H * IN_W;
-    input_desc.strides[1] = IN_H * IN_W;
-    input_desc.strides[2] = IN_W;
-    input_desc.strides[3] = 1;
-
-    printf("Loading and preprocessing image...\n");
+    printf("Loading and preprocessing %d image(s)...\n", num_images < batch ? num_images : batch);
     double preprocess_start = omp_get_wtime();
-    if (load_and_preprocess_image(image_path, in_buf) != 0) {
+    if (load_batch(image_paths, num_images, batch, in_buf) != 0) {
         free(in_buf);
+        free(out_buf);
         cleanup_classes();
         return 1;
     }
     double preprocess_time = (omp_get_wtime() - preprocess_start) * 1000.0;
     printf("Preprocessing time: %.3f ms\n", preprocess_time);
 
+    printf("Batch: %d%s\n", batch, num_images < batch ? " (image list repeated)" : "");
+    printf("Input layout: %s\n", input_is_nhwc() ? "NHWC" : "NCHW");
+    if (alexnet_isa) {
+        printf("ISA variant: %s\n", alexnet_isa());
+    }
+    printf("Threads: %d\n", omp_get_max_threads());
+    alexnet_alloc_init();
+    printf("Allocator: %s (ALEXNET_ALLOCATOR)\n", alloc_mode_name());
+
     printf("\nWarming up (%d runs)...\n", num_warmup);
     for (int i = 0; i < num_warmup; i++) {
-        void* result = alexnet(&input_desc);
-        if (result == NULL) {
-            fprintf(stderr, "ERROR: alexnet returned NULL during warmup\n");
-            free(in_buf);
-            cleanup_classes();
-            return 1;
-        }
+        alexnet_alloc_begin();
+        alexnet_copy_begin();
+        run_model(in_buf, out_buf, batch);
     }
 
     printf("Running benchmark (%d runs)...\n", num_benchmark);
     double total_time = 0.0;
     double min_time = INFINITY;
     double max_time = 0.0;
-    void* final_result = NULL;
+    uint64_t total_allocs = 0, total_bytes = 0, peak_live = 0;
+    uint64_t total_copies = 0, copied_bytes = 0;
 
     for (int i = 0; i < num_benchmark; i++) {
+        alexnet_alloc_begin();
+        alexnet_copy_begin();
         double start = omp_get_wtime();
-        void* result = alexnet(&input_desc);
+        run_model(in_buf, out_buf, batch);
         double end = omp_get_wtime();
 
+        AllocStats stats = alexnet_alloc_stats();
+        total_allocs += stats.allocs;
+        total_bytes += stats.bytes;
+        if (stats.peak > peak_live) peak_live = stats.peak;
+        CopyStats copies = alexnet_copy_stats();
+        total_copies += copies.calls;
+        copied_bytes += copies.bytes;
+
         double elapsed = (end - start) * 1000.0;
         total_time += elapsed;
         if (elapsed < min_time) min_time = elapsed;
         if (elapsed > max_time) max_time = elapsed;
-
-        if (i == num_benchmark - 1) {
-            final_result = result;
-        }
     }
 
     double avg_time = total_time / num_benchmark;
 
+    /* Latencies are per call, i.e. per batch. */
     printf("  Average: %.3f ms\n", avg_time);
     printf("  Min:     %.3f ms\n", min_time);
     printf("  Max:     %.3f ms\n", max_time);
-    printf("  Throughput: %.2f FPS\n", 1000.0 / avg_time);
-
-    if (final_result == NULL) {
-        fprintf(stderr, "ERROR: alexnet returned NULL\n");
-        free(in_buf);
-        cleanup_classes();
-        return 1;
-    }
-
-    float *out_buf = (float*)final_result;
+    printf("  Per image: %.3f ms\n", avg_time / batch);
+    printf("  Throughput: %.2f images/s\n", batch * 1000.0 / avg_time);
+    printf("  Allocations: %.1f per call, %.2f MB per call, peak live %.2f MB\n",
+           (double)total_allocs / num_benchmark,
+           total_bytes / (1024.0 * 1024.0) / num_benchmark, peak_live / (1024.0 * 1024.0));
+    printf("  memrefCopy: %.1f per call, %.2f MB per call\n",
+           (double)total_copies / num_benchmark,
+           copied_bytes / (1024.0 * 1024.0) / num_benchmark);
 
     float sum_check = 0.0f;
-    for (int i = 0; i < NUM_CLASSES; i++) {
+    for (size_t i = 0; i < output_elems; i++) {
         sum_check += fabsf(out_buf[i]);
     }
 
@@ -364,10 +563,22 @@ int main(int argc, char **argv) {
         }
         fprintf(stderr, "\n");
         free(in_buf);
+        free(out_buf);
         cleanup_classes();
         return 1;
     }
 
+    /* Raw logits of the last run (batch x NUM_CLASSES), for comparing builds
+     * (tools/conv_rewrite.py check). */
+    const char *logits_path = getenv("ALEXNET_LOGITS");
+    if (logits_path) {
+        FILE *lf = fopen(logits_path, "wb");
+        if (!lf || fwrite(out_buf, sizeof(float), output_elems, lf) != output_elems) {
+            fprintf(stderr, "Failed to write logits to '%s'\n", logits_path);
+        }
+        if (lf) fclose(lf);
+    }
+
     float *probs = (float*)calloc(NUM_CLASSES, sizeof(float));
     int *top_indices = (int*)calloc(5, sizeof(int));
     float *top_values = (float*)calloc(5, sizeof(float));
@@ -378,28 +589,41 @@ int main(int argc, char **argv) {
         if (top_indices) free(top_indices);
         if (top_values) free(top_values);
         free(in_buf);
+        free(out_buf);
         cleanup_classes();
         return 1;
     }
 
-    softmax(out_buf, probs, NUM_CLASSES);
-    get_topk(probs, NUM_CLASSES, 5, top_indices, top_values);
+    /* Top-5 of each listed image; repeated slots are not reported again. */
+    for (int b = 0; b < num_images && b < batch; b++) {
+        softmax(out_buf + (size_t)b * NUM_CLASSES, probs, NUM_CLASSES);
+        get_topk(probs, NUM_CLASSES, 5, top_indices, top_values);
 
-    printf("\n\nTop-5 Predictions\n\n");
-    for (int i = 0; i < 5; i++) {
-        if (top_indices[i] >= 0 && top_indices[i] < NUM_CLASSES) {
-            printf("%d. Class %4d (%-30s): %.2f%%\n", 
-                   i+1, 
-                   top_indices[i],
-                   get_class_name(top_indices[i]),
-                   top_values[i] * 100.0f);
+        printf("\n\nTop-5 Predictions");
+        if (batch > 1) {
+            printf(" (%s)", image_paths[b]);
+        }
+        printf("\n\n");
+        for (int i = 0; i < 5; i++) {
+            if (top_indices[i] >= 0 && top_indices[i] < NUM_CLASSES) {
+                printf("%d. Class %4d (%-30s): %.2f%%\n", 
+                       i+1, 
+                       top_indices[i],
+                       get_class_name(top_indices[i]),
+                       top_values[i] * 100.0f);
+            }
         }
     }
 
+    for (int i = 0; i < num_images; i++) {
+        free(image_paths[i]);
+    }
+    free(image_paths);
     free(probs);
     free(top_indices);
     free(top_values);
     free(in_buf);
+    free(out_buf);
     cleanup_classes();
 
     return 0;
@@ -1,109 +1,239 @@
 #!/bin/bash
 
+# --emit-bytecode and --text-stage N (inter-stage format) are handled by
+# scripts/common.sh.
+# --affine lowers linalg to affine.for instead of scf.for in Stage 5, so the
+# affine passes of Stage 6 see affine loops; affine is then lowered in Stage 8
+# ahead of the SCF to CF conversion.  --parallel lowers linalg to scf.parallel
+# and then to OpenMP; link with clang -fopenmp and pick the thread count with
+# the fourth argument of the driver (or OMP_NUM_THREADS).  --vector adds
+# Stage 1b, which tiles and vectorizes the convolutions and matmuls with the
+# transform script in transforms/vectorize_avx2.mlir, and lowers the vector
+# dialect in Stages 8 and 11.
+# --external-weights embed|mmap moves the weights out of the IR before Stage 1
+# (tools/weights.py externalize); the LLVM IR then only declares them.  They
+# are linked in from alexnet_weights.o, either embedded with .incbin (embed)
+# or mapped from alexnet_weights.bin by the driver at startup (mmap).
+# --isa-variants sse4.2,avx2,avx512 (or all) replaces -mcpu=native in Stages
+# 13-14: the IR is compiled once per ISA level and alexnet.o picks the variant
+# for the running CPU at load time (tools/isa.py).
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+source "$SCRIPT_DIR/../scripts/common.sh" "$@"
+set -- "${PIPELINE_ARGS[@]}"
+
+AFFINE=0
+PARALLEL=0
+VECTOR=0
+EXTERNAL_WEIGHTS=""
+ISA_VARIANTS=""
+while [ $# -gt 0 ]; do
+  case "$1" in
+    --affine) AFFINE=1 ;;
+    --parallel) PARALLEL=1 ;;
+    --external-weights) EXTERNAL_WEIGHTS="$2"; shift ;;
+    --vector) VECTOR=1 ;;
+    --isa-variants) ISA_VARIANTS="$2"; shift ;;
+    *) echo "Usage: $0 [--emit-bytecode] [--text-stage N]... [--affine | --parallel] [--vector] [--external-weights embed|mmap] [--isa-variants LIST]"; exit 1 ;;
+  esac
+  shift
+done
+
+LINALG_TO_LOOPS="--convert-linalg-to-loops"
+EARLY_LOWER_AFFINE=""
+if [ "$AFFINE" = 1 ]; then
+  LINALG_TO_LOOPS="--convert-linalg-to-affine-loops"
+  EARLY_LOWER_AFFINE="--lower-affine"
+fi
+SCF_TO_OPENMP=""
+OPENMP_TO_LLVM=""
+if [ "$PARALLEL" = 1 ]; then
+  if [ "$AFFINE" = 1 ]; then
+    echo "--affine and --parallel are exclusive"; exit 1
+  fi
+  LINALG_TO_LOOPS="--convert-linalg-to-parallel-loops"
+  SCF_TO_OPENMP="--convert-scf-to-openmp"
+  OPENMP_TO_LLVM="--convert-openmp-to-llvm"
+fi
+VECTOR_TO_SCF=""
+VECTOR_TO_LLVM=""
+if [ "$VECTOR" = 1 ]; then
+  VECTOR_TO_SCF="--convert-vector-to-scf"
+  VECTOR_TO_LLVM="--convert-vector-to-llvm=enable-x86vector=true"
+fi
+
+INPUT=alexnet_linalg.mlir
+WEIGHTS_ASM=""
+case "$EXTERNAL_WEIGHTS" in
+  "") ;;
+  embed) WEIGHTS_ASM=alexnet_weights_embed.s ;;
+  mmap) WEIGHTS_ASM=alexnet_weights.s ;;
+  *) echo "--external-weights takes embed or mmap"; exit 1 ;;
+esac
+if [ -n "$WEIGHTS_ASM" ]; then
+  if [ ! alexnet_linalg_ext.mlir -nt alexnet_linalg.mlir ]; then
+    echo "Moving the weights to alexnet_weights.bin..."
+    python3 "$SCRIPT_DIR/../tools/weights.py" externalize -i alexnet_linalg.mlir \
+      -o alexnet_linalg_ext.mlir --blob alexnet_weights.bin || exit 1
+  fi
+  INPUT=alexnet_linalg_ext.mlir
+fi
+
 # VECTORIZATION 
 
 # Stage 1: Initial cleanup
 echo "Stage 1: Initial canonicalization..."
-mlir-opt alexnet_linalg.mlir \
+mlir-opt "$INPUT" \
   --canonicalize \
   --cse \
-  -o vec_step1.mlir
+  $BC_FLAGS \
+  -o vec_step1.$EXT
+materialize_text 1 vec_step1
+STAGE2_INPUT=vec_step1.$EXT
+
+# Stage 1b: Tile and vectorize with the vector dialect (--vector only)
+if [ "$VECTOR" = 1 ]; then
+  echo "Stage 1b: Tile and vectorize convolutions and matmuls..."
+  mlir-opt vec_step1.$EXT \
+    --transform-preload-library="transform-library-paths=$SCRIPT_DIR/transforms/vectorize_avx2.mlir" \
+    --transform-interpreter \
+    --canonicalize \
+    $BC_FLAGS \
+    -o vec_step1b_vectorized.$EXT
+  materialize_text 1b vec_step1b_vectorized
+  STAGE2_INPUT=vec_step1b_vectorized.$EXT
+fi
 
 # Stage 2: Prepare for vectorization - fuse operations
 echo "Stage 2: Fuse elementwise operations..."
-mlir-opt vec_step1.mlir \
+mlir-opt $STAGE2_INPUT \
   --linalg-fuse-elementwise-ops \
   --linalg-fold-unit-extent-dims \
   --canonicalize \
   --cse \
-  -o vec_step2.mlir
+  $BC_FLAGS \
+  -o vec_step2.$EXT
+materialize_text 2 vec_step2
 
 # Stage 3: Generalize and prepare for tiling
 echo "Stage 3: Generalize named ops..."
-mlir-opt vec_step2.mlir \
+mlir-opt vec_step2.$EXT \
   --linalg-generalize-named-ops \
   --canonicalize \
-  -o vec_step3.mlir
+  $BC_FLAGS \
+  -o vec_step3.$EXT
+materialize_text 3 vec_step3
 
 # Stage 4: Bufferization (moved earlier, before vectorization)
 echo "Stage 4: Bufferize..."
-mlir-opt vec_step3.mlir \
+mlir-opt vec_step3.$EXT \
   --one-shot-bufferize="bufferize-function-boundaries function-boundary-type-conversion=identity-layout-map" \
+  --buffer-results-to-out-params="hoist-static-allocs" \
   --canonicalize \
-  -o vec_step4_bufferized.mlir
+  $BC_FLAGS \
+  -o vec_step4_bufferized.$EXT
+materialize_text 4 vec_step4_bufferized
 
 # Stage 4b: Handle deallocations immediately
 echo "Stage 4b: Lower deallocations..."
-mlir-opt vec_step4_bufferized.mlir \
+mlir-opt vec_step4_bufferized.$EXT \
   --buffer-deallocation-pipeline \
   --canonicalize \
-  -o vec_step4_dealloc.mlir
+  $BC_FLAGS \
+  -o vec_step4_dealloc.$EXT
+materialize_text 4b vec_step4_dealloc
 
 # Stage 5: Convert linalg to loops
 echo "Stage 5: Lower linalg to loops..."
-mlir-opt vec_step4_dealloc.mlir \
-  --convert-linalg-to-loops \
+mlir-opt vec_step4_dealloc.$EXT \
+  $LINALG_TO_LOOPS \
   --canonicalize \
   --cse \
-  -o vec_step5_loops.mlir
+  $BC_FLAGS \
+  -o vec_step5_loops.$EXT
+materialize_text 5 vec_step5_loops
 
 # Stage 6: Affine loop optimizations
 echo "Stage 6: Affine optimizations..."
-mlir-opt vec_step5_loops.mlir \
+mlir-opt vec_step5_loops.$EXT \
   --loop-invariant-code-motion \
   --affine-loop-fusion \
   --affine-loop-tile="tile-size=32" \
   --canonicalize \
   --cse \
-  -o vec_step6_affine_opt.mlir
+  $BC_FLAGS \
+  -o vec_step6_affine_opt.$EXT
+materialize_text 6 vec_step6_affine_opt
 
 # Stage 7: SCF optimizations
 echo "Stage 7: SCF optimizations..."
-mlir-opt vec_step6_affine_opt.mlir \
+mlir-opt vec_step6_affine_opt.$EXT \
   --scf-for-loop-peeling \
   --canonicalize \
-  -o vec_step7_scf_opt.mlir
+  $BC_FLAGS \
+  -o vec_step7_scf_opt.$EXT
+materialize_text 7 vec_step7_scf_opt
 
 # Stage 8: Lower SCF to CF
 echo "Stage 8: Lower SCF to CF..."
-mlir-opt vec_step7_scf_opt.mlir \
+mlir-opt vec_step7_scf_opt.$EXT \
+  $EARLY_LOWER_AFFINE \
+  $SCF_TO_OPENMP \
+  $VECTOR_TO_SCF \
   --convert-scf-to-cf \
   --canonicalize \
-  -o vec_step8_cf.mlir
+  $BC_FLAGS \
+  -o vec_step8_cf.$EXT
+materialize_text 8 vec_step8_cf
 
 # Stage 9: Lower affine and normalize memrefs
 echo "Stage 9: Lower affine..."
-mlir-opt vec_step8_cf.mlir \
+mlir-opt vec_step8_cf.$EXT \
   --lower-affine \
   --normalize-memrefs \
   --memref-expand \
   --fold-memref-alias-ops \
   --canonicalize \
-  -o vec_step9_lowered.mlir
+  $BC_FLAGS \
+  -o vec_step9_lowered.$EXT
+materialize_text 9 vec_step9_lowered
 
 # Stage 10: Expand strided metadata and lower affine again (for linearize_index)
 echo "Stage 10: Expand metadata and lower affine..."
-mlir-opt vec_step9_lowered.mlir \
+mlir-opt vec_step9_lowered.$EXT \
   --expand-strided-metadata \
   --lower-affine \
   --canonicalize \
-  -o vec_step10_expanded.mlir
+  $BC_FLAGS \
+  -o vec_step10_expanded.$EXT
+materialize_text 10 vec_step10_expanded
 
 # Stage 11: Final lowering to LLVM dialect
 echo "Stage 11: Convert to LLVM dialect..."
-mlir-opt vec_step10_expanded.mlir \
-  --finalize-memref-to-llvm \
+mlir-opt vec_step10_expanded.$EXT \
+  $VECTOR_TO_LLVM \
+  --finalize-memref-to-llvm="use-generic-functions=1" \
   --convert-arith-to-llvm \
   --convert-cf-to-llvm \
-  --convert-func-to-llvm \
+  --convert-func-to-llvm="use-bare-ptr-memref-call-conv=1" \
+  $OPENMP_TO_LLVM \
   --reconcile-unrealized-casts \
   --canonicalize \
-  -o vec_step11_llvm.mlir
+  $BC_FLAGS \
+  -o vec_step11_llvm.$EXT
+materialize_text 11 vec_step11_llvm
 
 # Stage 12: Translate to LLVM IR
 echo "Stage 12: Translate to LLVM IR..."
-mlir-translate --mlir-to-llvmir vec_step11_llvm.mlir > alexnet_vectorized.ll
+mlir-translate --mlir-to-llvmir vec_step11_llvm.$EXT > alexnet_vectorized.ll
 
+if [ -n "$ISA_VARIANTS" ]; then
+  # Stages 13-14 once per ISA level, behind a load-time CPU dispatcher.
+  echo "Stages 13-14: one variant per ISA level ($ISA_VARIANTS)..."
+  python3 "$SCRIPT_DIR/../tools/isa.py" build -i alexnet_vectorized.ll \
+    --opt-passes "default<O3>,loop-vectorize,slp-vectorizer,load-store-vectorizer" \
+    --llc-flags "-O3 -march=x86-64 -relocation-model=pic -enable-unsafe-fp-math -fp-contract=fast" \
+    --variants "$ISA_VARIANTS" -o alexnet.o || exit 1
+else
 # Stage 13: LLVM optimizations with aggressive vectorization
 #At this step, please ensure that the opt version matches your llvm version
 echo "Stage 13: LLVM optimizations..."
@@ -121,8 +251,13 @@ llc -O3 \
   -mattr=+avx2,+fma,+f16c \
   alexnet_vectorized.bc -o alexnet_vectorized.s  
 #.s can be further lowered to object file for better output
+fi
+if [ -n "$WEIGHTS_ASM" ]; then
+  clang -c $WEIGHTS_ASM -o alexnet_weights.o
+  echo "Weights ($EXTERNAL_WEIGHTS): add alexnet_weights.o after alexnet.o when linking"
+fi
 
 echo "Pipeline completed. Generated files: alexnet_vectorized.ll, alexnet_vectorized.bc, alexnet_vectorized.s"
 echo "Use this command to run the code:  gcc -march=native -O3 main.c alexnet.o     -L/usr/local/lib"
 echo "-L/path/to/llvm-project/build/lib     -lmlir_c_runner_utils     -lmlir_runner_utils"     
-echo "-lm     -Wl,-rpath,/path/to/llvm-project/build/lib     -o alexnet_infer -fopenmp""
+echo "-lm     -Wl,-rpath,/path/to/llvm-project/build/lib     -o alexnet_infer -fopenmp"
@@ -0,0 +1,81 @@
+// Tile-and-vectorize schedule for O2_pipeline.sh --vector (Stage 1b).
+//
+// Runs on tensors, before Stage 2 folds unit dimensions and Stage 3
+// generalizes the named ops.  Register tiles are sized for AVX2: 8 f32 lanes
+// per ymm register, 16 registers.
+module attributes {transform.with_named_sequence} {
+  transform.named_sequence @__transform_main(
+      %root: !transform.any_op {transform.readonly}) {
+    %func = transform.structured.match ops{["func.func"]} in %root
+      : (!transform.any_op) -> !transform.any_op
+
+    // Convolutions (n, f, oh, ow, c, kh, kw): 8 output channels x 8 output
+    // columns per tile, i.e. eight ymm accumulators, and 8 input channels per
+    // reduction step.  One output row and one kernel row per tile, so every
+    // tile decomposes into a 1-D convolution, which the vectorizer handles.
+    %convs = transform.structured.match ops{["linalg.conv_2d_nchw_fchw"]} in %root
+      : (!transform.any_op) -> !transform.any_op
+    %conv_tiles, %conv_loops:6 = transform.structured.tile_using_for %convs
+      tile_sizes [1, 8, 1, 8, 8, 1, 0]
+      : (!transform.any_op) -> (!transform.any_op, !transform.any_op, !transform.any_op,
+                                !transform.any_op, !transform.any_op, !transform.any_op,
+                                !transform.any_op)
+    // Output widths (55, 27, 13) are not multiples of 8: peel the column loop
+    // so the main loop only sees full, static tiles.  The remainder stays
+    // scalar and is lowered by Stage 5.
+    transform.sequence %conv_loops#3 : !transform.any_op failures(suppress) {
+    ^bb0(%columns: !transform.any_op):
+      %main, %rest = transform.loop.peel %columns
+        : (!transform.any_op) -> (!transform.any_op, !transform.any_op)
+      transform.yield
+    }
+    transform.apply_patterns to %func {
+      transform.apply_patterns.canonicalization
+    } : !transform.any_op
+    %full = transform.structured.match ops{["linalg.conv_2d_nchw_fchw"]} in %func
+      : (!transform.any_op) -> !transform.any_op
+    transform.sequence %full : !transform.any_op failures(suppress) {
+    ^bb0(%conv: !transform.any_op):
+      %conv1d = transform.structured.decompose %conv
+        : (!transform.any_op) -> !transform.any_op
+      transform.yield
+    }
+
+    // Fully-connected layers (m, n, k): two ymm registers of outputs per row
+    // and 8 steps of the reduction per tile.
+    %matmuls = transform.structured.match ops{["linalg.matmul"]} in %root
+      : (!transform.any_op) -> !transform.any_op
+    %mm_tiles, %mm_loops:3 = transform.structured.tile_using_for %matmuls
+      tile_sizes [4, 16, 8]
+      : (!transform.any_op) -> (!transform.any_op, !transform.any_op, !transform.any_op,
+                                !transform.any_op)
+
+    // Vectorize only the tiles above.  The bias, ReLU, fill and pool ops work
+    // on whole activations (e.g. 1x64x55x55) and would become whole-tensor
+    // vectors; they stay linalg and are lowered to loops with the rest.
+    // Each 1-D conv tile is vectorized on its own so that a tile the
+    // vectorizer rejects stays scalar without blocking the others.
+    %conv_rows = transform.structured.match ops{["linalg.conv_1d_ncw_fcw"]} in %func
+      : (!transform.any_op) -> !transform.any_op
+    transform.foreach %conv_rows : !transform.any_op {
+    ^bb0(%row: !transform.any_op):
+      transform.sequence %row : !transform.any_op failures(suppress) {
+      ^bb1(%tile: !transform.any_op):
+        transform.structured.vectorize %tile : !transform.any_op
+        transform.yield
+      }
+    }
+    // fc8's 1000 outputs leave a partial column tile, and batch 1 a partial
+    // row tile: vectorize at the tile sizes with masks.
+    transform.structured.vectorize %mm_tiles vector_sizes [4, 16, 8] : !transform.any_op
+
+    // Contractions become FMA outer products.
+    transform.apply_patterns to %func {
+      transform.apply_patterns.vector.lower_contraction lowering_strategy = "outerproduct"
+      transform.apply_patterns.vector.lower_outerproduct
+      transform.apply_patterns.vector.transfer_permutation_patterns
+      transform.apply_patterns.canonicalization
+    } : !transform.any_op
+    transform.yield
+  }
+}
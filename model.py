@@ -1,20 +1,54 @@
+import argparse
+import os
+import subprocess
+import sys
+
 import torch
 import torchvision.models as models
 from torch_mlir import fx  
 import torch_mlir
 
+parser = argparse.ArgumentParser(description="Export AlexNet to linalg-on-tensors MLIR")
+parser.add_argument("-o", "--output", default="alexnet_linalg.mlir")
+parser.add_argument("--batch", type=int, default=1,
+                    help="static batch size of the exported model (build main.c with "
+                         "-DBATCH=N to match)")
+parser.add_argument("--dynamic-batch", action="store_true",
+                    help="export the batch as a dynamic leading dimension (compile with "
+                         "phase_driver.py --dynamic-batch, build main.c with "
+                         "-DALEXNET_DYNAMIC_BATCH)")
+parser.add_argument("--external-weights", metavar="BLOB",
+                    help="also write <output>_ext.mlir, whose weights live in BLOB "
+                         "(see tools/weights.py externalize)")
+args = parser.parse_args()
+if args.batch < 1:
+    parser.error("--batch must be at least 1")
+
 alex = models.alexnet(weights=models.AlexNet_Weights.IMAGENET1K_V1).eval()
 
-example_input = torch.randn(1, 3, 224, 224)  
+# torch.export specializes a dimension of size 1, so a dynamic batch is
+# traced with two images.
+example_input = torch.randn(max(args.batch, 2) if args.dynamic_batch else args.batch,
+                            3, 224, 224)
+dynamic_shapes = None
+if args.dynamic_batch:
+    dynamic_shapes = {"x": {0: torch.export.Dim("batch", min=1, max=4096)}}
 
 mlir_module = fx.export_and_import(
     alex, 
     example_input, 
     output_type="linalg-on-tensors",
-    func_name="alexnet"
+    func_name="alexnet",
+    dynamic_shapes=dynamic_shapes
 )
 
-with open("alexnet_linalg.mlir", "w") as f:
+with open(args.output, "w") as f:
     f.write(str(mlir_module))
 
-print("Wrote alexnet_linalg.mlir")
+print("Wrote %s (batch %s)" % (args.output, "dynamic" if args.dynamic_batch else args.batch))
+
+if args.external_weights:
+    tools = os.path.join(os.path.dirname(os.path.abspath(__file__)), "tools")
+    subprocess.run([sys.executable, os.path.join(tools, "weights.py"), "externalize",
+                    "-i", args.output, "-o", os.path.splitext(args.output)[0] + "_ext.mlir",
+                    "--blob", args.external_weights], check=True)
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Setup shared by the pipeline scripts.  Source it with the script's
+# arguments, then continue with the ones it did not consume:
+#
+#   source "$SCRIPT_DIR/../scripts/common.sh" "$@"
+#   set -- "${PIPELINE_ARGS[@]}"
+#
+# Inter-stage format.  --emit-bytecode writes and reads .mlirbc between stages;
+# the weights (dense_resource blobs from torch-mlir) are then stored raw and
+# memory-mapped by the bytecode reader instead of being printed and re-parsed
+# as hex text.  --text-stage N also writes a readable .mlir for stage N.
+EMIT_BYTECODE=0
+TEXT_STAGES=""
+PIPELINE_ARGS=()
+while [ $# -gt 0 ]; do
+  case "$1" in
+    --emit-bytecode) EMIT_BYTECODE=1 ;;
+    --text-stage) TEXT_STAGES="$TEXT_STAGES $2"; shift ;;
+    *) PIPELINE_ARGS+=("$1") ;;
+  esac
+  shift
+done
+
+EXT=mlir
+BC_FLAGS=""
+if [ "$EMIT_BYTECODE" = 1 ]; then
+  EXT=mlirbc
+  BC_FLAGS="--emit-bytecode"
+fi
+
+# materialize_text <stage> <output without extension>
+materialize_text() {
+  if [ "$EMIT_BYTECODE" = 1 ] && [[ " $TEXT_STAGES " == *" $1 "* ]]; then
+    mlir-opt "$2.mlirbc" -o "$2.mlir"
+  fi
+}
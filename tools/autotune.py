@@ -0,0 +1,301 @@
+#!/usr/bin/env python3
+"""Evolutionary autotuner for MLIR and LLVM pass sequences.
+
+A candidate is a sequence of MLIR passes drawn from the pre-lowering stages
+of O1_pipeline.sh and O2_pipeline.sh, followed by the script's fixed lowering
+stages, plus a Stage 13 `opt -passes=` list drawn from the lists the two
+scripts use.  Fitness is the average alexnet() latency reported by the
+benchmark loop of Optimized_Pipeline_1/main.c; lower is better.
+
+Each generation breeds --jobs children by tournament selection, one-point
+crossover and mutation, and evaluates them in parallel.  The mutation
+operator is picked by a UCB1 bandit that is rewarded whenever a child beats
+its parent, so operators that keep paying off are used more.  Every
+evaluation and the population are saved to --state after each generation;
+rerunning the same command resumes, and --budget counts evaluations across
+runs.  The best candidate so far is written as a runnable script (--emit).
+
+Usage:
+  python3 tools/autotune.py -p o1 --image cat.jpg --budget 200
+  python3 tools/autotune.py -p o1 --image cat.jpg --budget 400   # resume
+"""
+
+import argparse
+import hashlib
+import json
+import math
+import os
+import random
+import sys
+from concurrent.futures import ThreadPoolExecutor
+
+from emit_script import write_script
+from evaluate import add_evaluator_args, evaluator_from_args
+from phase_search import DEFAULT_GROUPS
+from pipelines import BACKENDS, O1, O2, PIPELINES, Stage, parse_pass_flag, stage_label
+
+# Passes a candidate must contain; repair() keeps the first copy of each and
+# places deallocation and linalg-to-loops after bufferization.  The output
+# buffer is always turned into an out-parameter right after bufferization, so
+# every candidate links against the drivers' alexnet(input, logits).
+BUFFERIZE = '--one-shot-bufferize="bufferize-function-boundaries function-boundary-type-conversion=identity-layout-map"'
+OUT_PARAMS = '--buffer-results-to-out-params="hoist-static-allocs"'
+AFTER_BUFFERIZE = ["--buffer-deallocation-pipeline", "--convert-linalg-to-loops"]
+
+OPT_POOL = ["default<O3>", "loop-vectorize", "slp-vectorizer", "load-store-vectorizer"]
+
+OPERATORS = ["insert", "delete", "swap", "replace", "opt"]
+MAX_PASSES = 48
+
+
+def tunable_passes(stages, pipeline):
+    groups = DEFAULT_GROUPS[pipeline]
+    return [p for stage in stages if stage_label(stage) in groups for p in stage.passes]
+
+
+def fixed_tail(pipeline):
+    groups = DEFAULT_GROUPS[pipeline]
+    return [stage for stage in PIPELINES[pipeline] if stage_label(stage) not in groups]
+
+
+def pass_pool():
+    pool = []
+    for stages, name in ((O1, "o1"), (O2, "o2")):
+        for flag in tunable_passes(stages, name):
+            if flag not in pool:
+                pool.append(flag)
+    return pool
+
+
+def key(genome):
+    text = json.dumps(genome, sort_keys=True)
+    return hashlib.sha1(text.encode()).hexdigest()[:12]
+
+
+def pass_name(flag):
+    return parse_pass_flag(flag)[0]
+
+
+def repair(seq, rng):
+    """Make a pass sequence compilable without changing more than needed."""
+    required = [BUFFERIZE] + AFTER_BUFFERIZE
+    names = {pass_name(flag) for flag in required}
+    out, seen = [], set()
+    for flag in seq[:MAX_PASSES - len(required) - 1]:
+        name = pass_name(flag)
+        if name == pass_name(OUT_PARAMS):
+            continue
+        if name in names:
+            if name in seen:
+                continue
+            seen.add(name)
+        out.append(flag)
+    for flag in required:
+        if pass_name(flag) not in seen:
+            out.insert(rng.randint(0, len(out)), flag)
+    buf = next(i for i, flag in enumerate(out) if pass_name(flag) == pass_name(BUFFERIZE))
+    for flag in AFTER_BUFFERIZE:
+        i = next(i for i, f in enumerate(out) if pass_name(f) == pass_name(flag))
+        if i < buf:
+            moved = out.pop(i)
+            buf -= 1
+            out.insert(rng.randint(buf + 1, len(out)), moved)
+    out.insert(buf + 1, OUT_PARAMS)
+    return out
+
+
+def mutate(genome, op, pool, rng):
+    seq, opt = list(genome["mlir"]), list(genome["opt"])
+    if op == "insert" or not seq:
+        seq.insert(rng.randint(0, len(seq)), rng.choice(pool))
+    elif op == "delete":
+        seq.pop(rng.randrange(len(seq)))
+    elif op == "swap":
+        i, j = rng.randrange(len(seq)), rng.randrange(len(seq))
+        seq[i], seq[j] = seq[j], seq[i]
+    elif op == "replace":
+        seq[rng.randrange(len(seq))] = rng.choice(pool)
+    elif op == "opt":
+        if opt and rng.random() < 0.5:
+            opt.pop(rng.randrange(len(opt)))
+        else:
+            opt.insert(rng.randint(0, len(opt)), rng.choice(OPT_POOL))
+    return {"mlir": repair(seq, rng), "opt": opt}
+
+
+def crossover(a, b, rng):
+    i = rng.randint(0, len(a["mlir"]))
+    j = rng.randint(0, len(b["mlir"]))
+    return {"mlir": repair(a["mlir"][:i] + b["mlir"][j:], rng),
+            "opt": list(rng.choice((a, b))["opt"])}
+
+
+class Bandit:
+    """UCB1 over mutation operators."""
+
+    def __init__(self, stats=None):
+        self.stats = stats or {op: [0, 0.0] for op in OPERATORS}
+
+    def pick(self):
+        total = sum(n for n, _ in self.stats.values())
+        for op, (n, _) in self.stats.items():
+            if n == 0:
+                return op
+        return max(self.stats, key=lambda op: self.stats[op][1] / self.stats[op][0]
+                   + math.sqrt(2 * math.log(total) / self.stats[op][0]))
+
+    def reward(self, op, value):
+        self.stats[op][0] += 1
+        self.stats[op][1] += value
+
+
+def fitness(result):
+    if result and result["status"] == "ok" and result.get("latency_ms"):
+        return result["latency_ms"]
+    return float("inf")
+
+
+def candidate_stages(genome, pipeline):
+    tuned = Stage("Stage 1: Tuned MLIR passes...", "tuned_step1.mlir", genome["mlir"])
+    return [tuned] + fixed_tail(pipeline)
+
+
+def seeds(pipeline):
+    out = []
+    for stages, name in ((O1, "o1"), (O2, "o2")):
+        out.append({"mlir": tunable_passes(stages, name),
+                    "opt": BACKENDS[name].opt_passes.split(",")})
+    return out
+
+
+def load_state(path, pipeline, seed):
+    if os.path.exists(path):
+        with open(path) as f:
+            state = json.load(f)
+        if state["pipeline"] != pipeline:
+            sys.exit("%s was tuned for %s, not %s" % (path, state["pipeline"], pipeline))
+        return state
+    return {"pipeline": pipeline, "seed": seed, "generation": 0,
+            "population": seeds(pipeline), "evaluated": {}, "bandit": None}
+
+
+def save_state(path, state):
+    tmp = path + ".tmp"
+    with open(tmp, "w") as f:
+        json.dump(state, f, indent=1)
+    os.replace(tmp, path)
+
+
+def emit_best(state, path):
+    best = min(state["evaluated"].values(), key=lambda e: fitness(e["result"]), default=None)
+    if best is None or fitness(best["result"]) == float("inf"):
+        return None
+    genome, pipeline = best["genome"], state["pipeline"]
+    backend = BACKENDS[pipeline]._replace(opt_passes=",".join(genome["opt"]) or None)
+    write_script(path, candidate_stages(genome, pipeline), backend,
+                 "Generated by tools/autotune.py: %.3f ms average latency "
+                 "(candidate %s)" % (fitness(best["result"]), key(genome)))
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-p", "--pipeline", choices=["o1", "o2"], default="o1",
+                        help="script whose lowering stages and backend are kept")
+    parser.add_argument("--budget", type=int, default=100,
+                        help="total evaluations, including earlier runs")
+    parser.add_argument("--population", type=int, default=16)
+    parser.add_argument("--jobs", type=int, default=os.cpu_count(),
+                        help="children bred and evaluated per generation")
+    parser.add_argument("--bench-jobs", type=int, default=1,
+                        help="concurrent benchmark runs")
+    parser.add_argument("--crossover", type=float, default=0.3,
+                        help="probability a child comes from crossover")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--state", default="autotune_state.json")
+    parser.add_argument("--emit", default="tuned_pipeline.sh",
+                        help="script written for the best candidate")
+    add_evaluator_args(parser)
+    args = parser.parse_args()
+    if not args.image:
+        parser.error("--image is required: fitness is the measured latency")
+
+    state = load_state(args.state, args.pipeline, args.seed)
+    rng = random.Random("%d/%d" % (state["seed"], state["generation"]))
+    bandit = Bandit(state["bandit"])
+    pool = pass_pool()
+    evaluator = evaluator_from_args(args, bench_jobs=args.bench_jobs)
+    evaluator.prepare()
+
+    def run(batch):
+        with ThreadPoolExecutor(max_workers=args.jobs) as workers:
+            results = workers.map(
+                lambda g: evaluator.evaluate(key(g), candidate_stages(g, args.pipeline),
+                                             args.pipeline, ",".join(g["opt"])), batch)
+            for genome, result in zip(batch, results):
+                state["evaluated"][key(genome)] = {"genome": genome, "result": result}
+                print("  %s: %s" % (key(genome), "%.3f ms" % fitness(result)
+                                    if fitness(result) != float("inf") else result["status"]))
+
+    pending = [g for g in state["population"] if key(g) not in state["evaluated"]]
+    if pending:
+        print("Evaluating %d seed candidates..." % len(pending))
+        run(pending)
+        save_state(args.state, state)
+
+    while len(state["evaluated"]) < args.budget:
+        state["generation"] += 1
+        population = state["population"]
+        score = {key(g): fitness(state["evaluated"][key(g)]["result"]) for g in population}
+
+        def tournament():
+            return min(rng.sample(population, min(3, len(population))),
+                       key=lambda g: score[key(g)])
+
+        children, parents, ops = [], [], []
+        room = min(args.jobs, args.budget - len(state["evaluated"]))
+        for _ in range(20 * room):
+            if len(children) == room:
+                break
+            parent = tournament()
+            if rng.random() < args.crossover:
+                op, child = "crossover", crossover(parent, tournament(), rng)
+            else:
+                op = bandit.pick()
+                child = mutate(parent, op, pool, rng)
+            if key(child) in state["evaluated"] or child in children:
+                continue
+            children.append(child)
+            parents.append(parent)
+            ops.append(op)
+        if not children:
+            print("No new candidates left to try")
+            break
+
+        print("Generation %d: %d candidates" % (state["generation"], len(children)))
+        run(children)
+        for child, parent, op in zip(children, parents, ops):
+            if op != "crossover":
+                child_fit = fitness(state["evaluated"][key(child)]["result"])
+                bandit.reward(op, 1.0 if child_fit < score[key(parent)] else 0.0)
+
+        ranked = sorted(population + children,
+                        key=lambda g: fitness(state["evaluated"][key(g)]["result"]))
+        state["population"] = ranked[:args.population]
+        state["bandit"] = bandit.stats
+        save_state(args.state, state)
+        best = emit_best(state, args.emit)
+        if best:
+            print("  best so far: %.3f ms" % fitness(best["result"]))
+
+    best = emit_best(state, args.emit)
+    if best is None:
+        print("No candidate compiled and ran successfully")
+        return 1
+    print("Best: %.3f ms after %d evaluations, written to %s"
+          % (fitness(best["result"]), len(state["evaluated"]), args.emit))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
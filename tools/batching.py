@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+"""Throughput of AlexNet against batch size.
+
+At batch 1 the fully-connected layers are matrix-vector products: fc6 reads
+its 9216x4096 weights (151 MB) once per image, so they are bound by memory
+bandwidth.  A batch of N images reads the same weights once for N images.
+The convolutions gain less, because each one already reuses its filters
+across the output positions.
+
+model.py exports either a static batch (--batch N) or a dynamic leading
+dimension (--dynamic-batch).  Static models keep the bare-pointer ABI of the
+O1/O2 drivers, which are built with -DBATCH=N.  Bare pointers cannot carry
+a dynamic size, so --dynamic-batch (here and in phase_driver.py) switches
+convert-func-to-llvm back to the default calling convention.  The driver is
+then built with -DALEXNET_DYNAMIC_BATCH and passes the batch size in the
+memref descriptors.
+
+`report` builds and runs each batch size and prints latency per batch,
+latency per image and images/s.  For static batches, -i names one export per
+batch through a {batch} placeholder; --export writes missing ones with
+model.py.  For a dynamic export, one build is run at every size
+(ALEXNET_BATCH).
+
+Usage:
+  python3 model.py --batch 16 -o alexnet_linalg_b16.mlir
+  python3 tools/batching.py report -p o1 -i alexnet_linalg_b{batch}.mlir --export --image cat.jpg
+  python3 model.py --dynamic-batch -o alexnet_linalg_dyn.mlir
+  python3 tools/phase_driver.py -p o1 -i alexnet_linalg_dyn.mlir --dynamic-batch
+  python3 tools/batching.py report -p o1 -i alexnet_linalg_dyn.mlir --dynamic --image cat.jpg
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+from pipelines import PIPELINES, parse_pass_flag
+
+REPO_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+FUNC_TO_LLVM = "convert-func-to-llvm"
+DEFAULT_BATCHES = (1, 4, 16, 64)
+SIGNATURE = re.compile(r"func\.func @alexnet\(%arg0: tensor<(\?|\d+)x")
+
+
+def descriptor_abi(stages):
+    """`stages` with convert-func-to-llvm using the default calling convention."""
+    out = []
+    for stage in stages:
+        passes = ["--" + FUNC_TO_LLVM if parse_pass_flag(p)[0] == FUNC_TO_LLVM else p
+                  for p in stage.passes]
+        out.append(stage._replace(passes=passes))
+    return out
+
+
+def input_batch(path):
+    """Batch size of an exported model, or None when it is dynamic."""
+    with open(path, errors="replace") as f:
+        for line in f:
+            match = SIGNATURE.search(line)
+            if match:
+                return None if match.group(1) == "?" else int(match.group(1))
+    raise ValueError("%s: no @alexnet signature (text MLIR expected)" % path)
+
+
+def export(path, batch):
+    """Write a static export of `batch` images to `path` with model.py."""
+    print("Exporting batch %d to %s..." % (batch, path))
+    subprocess.run([sys.executable, os.path.join(REPO_DIR, "model.py"),
+                    "--batch", str(batch), "-o", path], check=True)
+
+
+def build(evaluator, workdir, stages, pipeline):
+    os.makedirs(workdir, exist_ok=True)
+    obj = evaluator.compile(workdir, stages, pipeline, dedup=False)
+    return evaluator.link(workdir, obj)
+
+
+def measure(evaluator, binary, batch, env=None):
+    """Latency of one call (one batch) and the throughput it implies."""
+    avg, best = evaluator.run(binary, evaluator.threads, env=env)
+    if avg is None:
+        sys.exit("no latency in the output of %s for batch %d" % (binary, batch))
+    return {"batch": batch, "latency_ms": avg, "min_ms": best,
+            "per_image_ms": round(avg / batch, 3),
+            "images_per_s": round(batch * 1000.0 / avg, 2)}
+
+
+def report(args):
+    from evaluate import evaluator_from_args
+
+    stages = PIPELINES[args.pipeline]
+    if args.dynamic:
+        if input_batch(args.input) is not None:
+            sys.exit("%s has a static batch; export it with model.py --dynamic-batch"
+                     % args.input)
+        # One model and driver for every size.
+        evaluator = evaluator_from_args(args)
+        evaluator.cflags.append("-DALEXNET_DYNAMIC_BATCH")
+        evaluator.prepare()
+        print("Building %s with a dynamic batch..." % args.pipeline)
+        binary = build(evaluator, os.path.join(evaluator.workroot,
+                                               "batch_%s_dynamic" % args.pipeline),
+                       descriptor_abi(stages), args.pipeline)
+    elif "{batch}" not in args.input:
+        sys.exit("static batches need one export per size: -i with {batch}, "
+                 "e.g. alexnet_linalg_b{batch}.mlir (or --dynamic)")
+    template = args.input
+
+    rows = []
+    for batch in args.batches:
+        env = None
+        if args.dynamic:
+            env = {"ALEXNET_BATCH": str(batch)}
+        else:
+            args.input = template.format(batch=batch)
+            if not os.path.exists(args.input) and args.export:
+                export(args.input, batch)
+            if input_batch(args.input) != batch:
+                sys.exit("%s does not have batch %d" % (args.input, batch))
+            evaluator = evaluator_from_args(args)
+            evaluator.cflags.append("-DBATCH=%d" % batch)
+            evaluator.prepare()
+            print("Building %s with batch %d..." % (args.pipeline, batch))
+            binary = build(evaluator, os.path.join(evaluator.workroot, "batch_%s_%d"
+                                                   % (args.pipeline, batch)),
+                           stages, args.pipeline)
+        rows.append(measure(evaluator, binary, batch, env))
+        print("  batch %d: %.3f ms, %.2f images/s" % (batch, rows[-1]["latency_ms"],
+                                                      rows[-1]["images_per_s"]))
+
+    # Speedup in images/s over the smallest batch, normally 1.
+    base = rows[0]["images_per_s"]
+    print("\n%6s %14s %14s %12s %9s" % ("batch", "per batch", "per image", "images/s",
+                                         "speedup"))
+    for r in rows:
+        r["speedup"] = round(r["images_per_s"] / base, 3)
+        print("%6d %11.3f ms %11.3f ms %12.2f %8.2fx" % (
+            r["batch"], r["latency_ms"], r["per_image_ms"], r["images_per_s"],
+            r["speedup"]))
+    return rows
+
+
+def main():
+    from evaluate import add_evaluator_args
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("report", help="images/s for each batch size")
+    p.add_argument("-p", "--pipeline", default="o1",
+                   choices=sorted(name for name in PIPELINES if name != "baseline"))
+    p.add_argument("--batches", default=",".join(map(str, DEFAULT_BATCHES)),
+                   help="comma-separated batch sizes (default %(default)s)")
+    p.add_argument("--dynamic", action="store_true",
+                   help="-i is a dynamic-batch export, built once and run at every size")
+    p.add_argument("--export", action="store_true",
+                   help="export missing static batches with model.py (needs torch)")
+    p.add_argument("-o", "--output", default="batch_throughput.json")
+    add_evaluator_args(p)
+    args = parser.parse_args()
+    if not args.image:
+        parser.error("--image is required")
+    args.batches = sorted(int(b) for b in args.batches.split(","))
+
+    rows = report(args)
+    with open(args.output, "w") as f:
+        json.dump({"pipeline": args.pipeline, "dynamic": args.dynamic, "curve": rows}, f,
+                  indent=1)
+    print("Wrote %s" % args.output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
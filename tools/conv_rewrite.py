@@ -0,0 +1,453 @@
+#!/usr/bin/env python3
+"""Alternative lowerings of the AlexNet convolutions, per layer.
+
+The rewrites run on tensors, right after Stage 1, while the convolutions are
+still named linalg.conv_2d_nchw_fchw ops.  Layers are named in network order
+like the loop nests of tiling.py: conv1..conv5, then fc6..fc8.  The names are
+given once, before the first rewrite, so conv4 is still conv4 after conv2
+was rewritten into something else.
+
+- --conv-im2col="conv2 conv3 packed-sizes=8,32,64" rewrites each listed
+  convolution into an im2col copy plus a GEMM.  The GEMM is packed into
+  cache blocks of the given (m, n, k) sizes.  With no layers listed, it
+  rewrites all of them.
+- --conv-winograd="conv3 conv4 conv5" computes each listed 3x3 stride-1
+  convolution with Winograd F(4x4, 3x3).  The layer is switched to NHWC and
+  rewritten with linalg's Winograd transforms.  The filter transform is then
+  evaluated here, from the constant weights, so the compiled code only
+  transforms inputs and outputs.  Its matrix G is read from linalg's own
+  decomposition of a filter transform, so the fold matches the B^T and A^T
+  the compiled code uses.  With no layers listed, it rewrites every
+  eligible one.
+
+These are driver-side steps (see DRIVER_PASSES in phase_driver.py); the
+driver's --im2col and --winograd options add one to any pipeline.  `bench`
+compiles the pipeline with the rewrite on each layer alone and on all layers,
+and reports the latency change against the direct loops.  `check` runs the
+rewritten and the direct builds on an image and compares their logits.
+
+Usage:
+  python3 tools/phase_driver.py -p o1 --im2col conv2,conv3,conv4,conv5
+  python3 tools/conv_rewrite.py bench im2col -p o1 --image cat.jpg
+  python3 tools/conv_rewrite.py check winograd -p o1 --image cat.jpg
+"""
+
+import argparse
+import json
+import os
+import struct
+import sys
+
+from pipelines import PIPELINES, parse_pass_flag, stage_label
+from tiling import apply_transform, match_tagged, walk_ops
+from weights import Weights, is_constant, resource_constant
+
+IM2COL_PASS = "conv-im2col"
+WINOGRAD_PASS = "conv-winograd"
+NAMED_CONV = "linalg.conv_2d_nchw_fchw"
+# The convolutions after --propagate-layout (layout.py).
+NHWC_CONV = "linalg.conv_2d_nhwc_fhwc"
+TAG = "conv_rewrite"
+# --pack-weights (weight_packing.py) is placed by with_conv_step() as well.
+PACK_PASS = "pack-weights"
+# Rewrites at the start of the stage after Stage 1, run in the order added.
+REWRITES = (IM2COL_PASS, WINOGRAD_PASS, PACK_PASS)
+LAYER_OPS = (NAMED_CONV, NHWC_CONV, "linalg.matmul")
+# Discardable attribute holding the name named_layers() gave a layer.
+LAYER_ATTR = "layer"
+# (m, n, k) blocks of the packed GEMM: 8 output channels, 32 output pixels,
+# 64 reduction elements, so one packed block of each operand fits in L1.
+DEFAULT_PACKED_SIZES = [8, 32, 64]
+
+
+def named_layers(module):
+    """[(name, op)] of the named convolutions and matmuls, in network order.
+
+    The first call names them by position and records the name on each op in
+    a `layer` attribute; later calls read it back.  A name keeps meaning the
+    same layer after earlier steps rewrote some of the others away.
+    """
+    from mlir.ir import StringAttr
+
+    ops = [op for op in walk_ops(module.operation) if op.name in LAYER_OPS]
+    if not any(LAYER_ATTR in op.attributes for op in ops):
+        for layer, op in enumerate(ops, 1):
+            kind = "fc" if op.name == "linalg.matmul" else "conv"
+            op.attributes[LAYER_ATTR] = StringAttr.get("%s%d" % (kind, layer))
+    return [(StringAttr(op.attributes[LAYER_ATTR]).value, op) for op in ops
+            if LAYER_ATTR in op.attributes]
+
+
+def copy_layer(op, new):
+    """Give `new`, which replaces `op`, the layer name of `op`."""
+    if LAYER_ATTR in op.attributes:
+        new.attributes[LAYER_ATTR] = op.attributes[LAYER_ATTR]
+
+
+def _selected(module, names):
+    convs = {name: op for name, op in named_layers(module) if op.name == NAMED_CONV}
+    if not names or names == ["all"]:
+        return convs
+    missing = [name for name in names if name not in convs]
+    if missing:
+        raise ValueError("no convolution named %s in this module" % ", ".join(missing))
+    return {name: convs[name] for name in names}
+
+
+CANONICALIZE = [
+    '%funcs = transform.structured.match ops{["func.func"]} in %root '
+    ": (!transform.any_op) -> !transform.any_op",
+    "transform.apply_patterns to %funcs { transform.apply_patterns.canonicalization } "
+    ": !transform.any_op",
+]
+
+LOWER_PACKING = [
+    '%packs = transform.structured.match ops{["linalg.pack"]} in %root '
+    ': (!transform.any_op) -> !transform.op<"linalg.pack">',
+    "%pads, %expands, %transposes = transform.structured.lower_pack %packs "
+    ": (!transform.op<\"linalg.pack\">) -> (!transform.op<\"tensor.pad\">, "
+    "!transform.op<\"tensor.expand_shape\">, !transform.op<\"linalg.transpose\">)",
+    '%unpacks = transform.structured.match ops{["linalg.unpack"]} in %root '
+    ': (!transform.any_op) -> !transform.op<"linalg.unpack">',
+    "%empties, %untransposes, %collapses, %slices = transform.structured.lower_unpack "
+    "%unpacks : (!transform.op<\"linalg.unpack\">) -> "
+    "(!transform.op<\"tensor.empty\">, !transform.op<\"linalg.transpose\">, "
+    "!transform.op<\"tensor.collapse_shape\">, !transform.op<\"tensor.extract_slice\">)",
+]
+
+
+def im2col_pass(module, options):
+    """Driver implementation of --conv-im2col."""
+    names = [key for key, value in options if value is None]
+    sizes = dict(options).get("packed-sizes")
+    sizes = [int(s) for s in sizes.split(",")] if sizes else DEFAULT_PACKED_SIZES
+    convs = _selected(module, names)
+    body = []
+    for n, name in enumerate(sorted(convs)):
+        body.append(match_tagged("%%conv%d" % n, name, TAG))
+        body.append("%%col%d, %%res%d = transform.structured.convert_conv2d_to_img2col "
+                    "%%conv%d : (!transform.any_op) -> (!transform.any_op, !transform.any_op)"
+                    % (n, n, n))
+        body.append("%%gemm%d = transform.get_consumers_of_result %%col%d[0] "
+                    ": (!transform.any_op) -> !transform.any_op" % (n, n))
+        body.append("%%packed%d = transform.structured.pack_greedily %%gemm%d "
+                    "matmul_packed_sizes = [%s] matmul_inner_dims_order = [0, 1, 2] "
+                    ": (!transform.any_op) -> !transform.op<\"linalg.generic\">"
+                    % (n, n, ", ".join(str(s) for s in sizes)))
+    apply_transform(module, body + LOWER_PACKING + CANONICALIZE, convs, TAG)
+
+
+# -- Winograd F(4x4, 3x3) ----------------------------------------------------
+
+WINOGRAD_FMR = "#linalg.fmr<F_4_3>"
+# One filter transform of F(4, 3) on a single 3x3 filter (FHWC -> 6x6xCxF),
+# decomposed to read the G that linalg pairs with its B^T and A^T.
+FILTER_PROBE = '''
+func.func @filter(%%arg0: tensor<1x3x3x1xf32>) -> tensor<6x6x1x1xf32> {
+  %%0 = tensor.empty() : tensor<6x6x1x1xf32>
+  %%1 = "linalg.winograd_filter_transform"(%%arg0, %%0) <{fmr = %s}>
+      : (tensor<1x3x3x1xf32>, tensor<6x6x1x1xf32>) -> tensor<6x6x1x1xf32>
+  return %%1 : tensor<6x6x1x1xf32>
+}
+''' % WINOGRAD_FMR
+
+
+def _int_list(attr):
+    from mlir.ir import DenseIntElementsAttr
+
+    return [int(v) for v in DenseIntElementsAttr(attr)]
+
+
+def winograd_eligible(op):
+    """Constant 3x3 filters, unit strides and dilations."""
+    from mlir.ir import ShapedType
+
+    filt = ShapedType(op.operands[1].type).shape
+    return (is_constant(op.operands[1]) and filt[2:] == [3, 3]
+            and _int_list(op.attributes["strides"]) == [1, 1]
+            and _int_list(op.attributes["dilations"]) == [1, 1])
+
+
+def _to_nhwc(conv, weights):
+    """Replace an NCHW convolution with an NHWC one between two transposes.
+
+    The filter is transposed here, into an inline FHWC constant.
+    """
+    from mlir.dialects import arith, linalg, tensor
+    from mlir.dialects._ods_common import _get_op_result_or_value as result
+    from mlir.ir import (DenseElementsAttr, F32Type, InsertionPoint, RankedTensorType,
+                         ShapedType)
+
+    inp, filt, init = conv.operands
+    f32 = F32Type.get()
+    fhwc_weights = weights.array(filt).transpose(0, 2, 3, 1).copy()
+    with InsertionPoint(conv), conv.location:
+        def transpose(value, perm):
+            shape = ShapedType(value.type).shape
+            empty = tensor.EmptyOp([shape[p] for p in perm], f32)
+            return result(linalg.transpose(value, outs=[empty], permutation=perm))
+
+        fhwc = arith.ConstantOp(RankedTensorType.get(list(fhwc_weights.shape), f32),
+                                DenseElementsAttr.get(fhwc_weights))
+        nhwc = result(linalg.conv_2d_nhwc_fhwc(
+            transpose(inp, [0, 2, 3, 1]), fhwc.result,
+            outs=[transpose(init, [0, 2, 3, 1])], strides=[1, 1], dilations=[1, 1]))
+        nchw = transpose(nhwc, [0, 3, 1, 2])
+    conv.result.replace_all_uses_with(nchw)
+    copy_layer(conv, nhwc.owner)
+    conv.erase()
+    return nhwc.owner
+
+
+def filter_matrix():
+    """G of linalg's F(4, 3) filter transform, from its decomposition.
+
+    The decomposition computes G g G^T with G (6x3) and G^T (3x6) as
+    constants; anything else means the fold below would not match it.
+    """
+    import numpy as np
+    from mlir.ir import DenseElementsAttr, Module, RankedTensorType
+
+    probe = Module.parse(FILTER_PROBE)
+    apply_transform(probe, DECOMPOSE_FILTER, {}, TAG)
+    found = {(6, 3): [], (3, 6): []}
+    for op in walk_ops(probe.operation):
+        if op.name != "arith.constant" or not RankedTensorType.isinstance(op.results[0].type):
+            continue
+        shape = tuple(RankedTensorType(op.results[0].type).shape)
+        if shape in found:
+            value = DenseElementsAttr(op.attributes["value"])
+            found[shape].append(np.array(value, dtype=np.float64).reshape(shape))
+    g, gt = found[(6, 3)], found[(3, 6)]
+    if len(g) != 1 or len(gt) != 1 or not np.allclose(gt[0], g[0].T):
+        raise ValueError("linalg's F(4, 3) filter transform is not G g G^T with one constant "
+                         "G; cannot fold it")
+    return g[0]
+
+
+def fold_filter_transforms(module, weights):
+    """Evaluate winograd_filter_transform ops of constant filters.
+
+    U = G g G^T for every (output, input) channel pair, (F, 3, 3, C) ->
+    (6, 6, C, F), stored as a dense_resource like the other weights.  G is
+    filter_matrix().
+    """
+    import numpy as np
+    from mlir.ir import InsertionPoint
+
+    g = filter_matrix()
+    ops = [op for op in walk_ops(module.operation)
+           if op.name == "linalg.winograd_filter_transform"]
+    folded = 0
+    for op in ops:
+        filt = weights.source(op.operands[0])
+        if filt is None:
+            continue
+        u = np.einsum("ai,fijc,bj->abcf", g, filt, g)
+        with InsertionPoint(op), op.location:
+            const = resource_constant(u, "winograd_filter_%d" % folded, op.results[0].type)
+        op.results[0].replace_all_uses_with(const.result)
+        op.erase()
+        folded += 1
+    return folded
+
+
+DECOMPOSE_FILTER = [
+    '%filters = transform.structured.match ops{["linalg.winograd_filter_transform"]} '
+    'in %root : (!transform.any_op) -> !transform.any_op',
+    "%decomposed = transform.structured.decompose_winograd_op %filters "
+    ": (!transform.any_op) -> !transform.any_op",
+]
+
+DECOMPOSE_WINOGRAD = [
+    '%transforms = transform.structured.match ops{["linalg.winograd_input_transform", '
+    '"linalg.winograd_output_transform"]} in %root : (!transform.any_op) -> !transform.any_op',
+    "%decomposed = transform.structured.decompose_winograd_op %transforms "
+    ": (!transform.any_op) -> !transform.any_op",
+] + CANONICALIZE
+
+
+def winograd_pass(module, options):
+    """Driver implementation of --conv-winograd."""
+    names = [key for key, value in options if value is None]
+    convs = _selected(module, names)
+    eligible = {name: op for name, op in convs.items() if winograd_eligible(op)}
+    if names and len(eligible) < len(convs):
+        raise ValueError("not a 3x3 stride-1 convolution with constant weights: %s"
+                         % ", ".join(sorted(set(convs) - set(eligible))))
+    if not eligible:
+        return
+    weights = Weights(module)
+    nhwc = {name: _to_nhwc(op, weights) for name, op in sorted(eligible.items())}
+    body = []
+    for n, name in enumerate(sorted(nhwc)):
+        body.append(match_tagged("%%conv%d" % n, name, TAG))
+        body.append("%%winograd%d = transform.structured.winograd_conv2d %%conv%d "
+                    "{ fmr = %s } : (!transform.any_op) -> !transform.any_op"
+                    % (n, n, WINOGRAD_FMR))
+    apply_transform(module, body, nhwc, TAG)
+    fold_filter_transforms(module, weights)
+    apply_transform(module, DECOMPOSE_WINOGRAD, {}, TAG)
+
+
+def conv_flag(pass_name, layers, extra=()):
+    return '--%s="%s"' % (pass_name, " ".join(list(layers) + list(extra)))
+
+
+def with_conv_step(stages, flag):
+    """Stage list with a conv rewrite in the stage after Stage 1.
+
+    It goes after the rewrites already placed there, so they run in the
+    order they were added and a later one only sees the layers the earlier
+    ones left.
+    """
+    name = parse_pass_flag(flag)[0]
+    out, inserted = [], False
+    for stage in stages:
+        passes = [p for p in stage.passes if parse_pass_flag(p)[0] != name]
+        if out and not inserted and stage_label(out[-1]) == "1":
+            i = 0
+            while i < len(passes) and parse_pass_flag(passes[i])[0] in REWRITES:
+                i += 1
+            passes.insert(i, flag)
+            inserted = True
+        out.append(stage._replace(passes=passes))
+    if not inserted:
+        raise ValueError("pipeline has no stage after Stage 1 to rewrite convolutions in")
+    return out
+
+
+# -- Per-layer benchmark -------------------------------------------------------------
+
+MODES = {
+    "im2col": (IM2COL_PASS, ["conv1", "conv2", "conv3", "conv4", "conv5"]),
+    # conv1 (11x11, stride 4) and conv2 (5x5) have no F(4x4, 3x3) form.
+    "winograd": (WINOGRAD_PASS, ["conv3", "conv4", "conv5"]),
+}
+
+
+def bench(mode, pipeline, evaluator, layers=None):
+    pass_name, default_layers = MODES[mode]
+    layers = layers or default_layers
+    stages = PIPELINES[pipeline]
+    variants = [("direct", stages)]
+    variants += [(layer, with_conv_step(stages, conv_flag(pass_name, [layer])))
+                 for layer in layers]
+    variants.append(("all", with_conv_step(stages, conv_flag(pass_name, layers))))
+    rows = []
+    for label, candidate in variants:
+        result = evaluator.evaluate("%s_%s_%s" % (mode, pipeline, label), candidate, pipeline)
+        result["variant"] = label
+        rows.append(result)
+        print("  %s: %s" % (label, "%.3f ms" % result["latency_ms"]
+                            if result.get("latency_ms") else result["status"]))
+    return rows
+
+
+def print_bench(mode, rows):
+    direct = rows[0].get("latency_ms")
+    print("\n%-8s %12s %12s %9s" % (mode, "latency", "change", "speedup"))
+    for r in rows:
+        ms = r.get("latency_ms")
+        if not ms:
+            print("%-8s %12s" % (r["variant"], r["status"]))
+            continue
+        print("%-8s %9.3f ms %9.3f ms %8.2fx" % (
+            r["variant"], ms, ms - direct if direct else 0.0,
+            direct / ms if direct else 0.0))
+
+
+# -- Accuracy check ----------------------------------------------------------
+
+# The benchmark driver writes the raw f32 logits of its last run to this file.
+LOGITS_ENV = "ALEXNET_LOGITS"
+
+
+def logits(evaluator, workdir, stages, pipeline):
+    os.makedirs(workdir, exist_ok=True)
+    obj = evaluator.compile(workdir, stages, pipeline, dedup=False)
+    binary = evaluator.link(workdir, obj)
+    path = os.path.join(workdir, "logits.bin")
+    evaluator.run(binary, evaluator.threads, env={LOGITS_ENV: path})
+    with open(path, "rb") as f:
+        data = f.read()
+    return list(struct.unpack("<%df" % (len(data) // 4), data))
+
+
+def top5(values):
+    return sorted(range(len(values)), key=lambda i: -values[i])[:5]
+
+
+def check(mode, pipeline, evaluator, layers=None, tolerance=1e-3):
+    """Logits of the rewritten build against the direct one, on one image.
+
+    The error is relative to the largest direct logit.  The check passes when
+    it is within `tolerance` and the top-1 class is the same.
+    """
+    pass_name, default_layers = MODES[mode]
+    layers = layers or default_layers
+    stages = PIPELINES[pipeline]
+    root = os.path.join(evaluator.workroot, "check_%s_%s" % (mode, pipeline))
+    print("Building %s with and without %s on %s..." % (pipeline, mode, ",".join(layers)))
+    direct = logits(evaluator, os.path.join(root, "direct"), stages, pipeline)
+    rewritten = logits(evaluator, os.path.join(root, mode),
+                       with_conv_step(stages, conv_flag(pass_name, layers)), pipeline)
+    scale = max(abs(v) for v in direct) or 1.0
+    error = max(abs(a - b) for a, b in zip(direct, rewritten))
+    report = {"mode": mode, "pipeline": pipeline, "layers": layers,
+              "max_abs_error": error, "max_rel_error": error / scale,
+              "top1_match": top5(direct)[0] == top5(rewritten)[0],
+              "top5_overlap": len(set(top5(direct)) & set(top5(rewritten))),
+              "tolerance": tolerance}
+    report["ok"] = report["max_rel_error"] <= tolerance and report["top1_match"]
+    return report
+
+
+def main():
+    from evaluate import add_evaluator_args, evaluator_from_args
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("bench", help="latency with the rewrite on each layer and on all")
+    p.add_argument("mode", choices=sorted(MODES))
+    p.add_argument("-p", "--pipeline", choices=sorted(PIPELINES), default="o1")
+    p.add_argument("--layers", help="comma-separated layers (default: every eligible one)")
+    p.add_argument("-o", "--output", default="conv_bench.json")
+    add_evaluator_args(p)
+    p = sub.add_parser("check", help="compare the logits of the rewrite with the direct path")
+    p.add_argument("mode", choices=sorted(MODES))
+    p.add_argument("-p", "--pipeline", choices=sorted(PIPELINES), default="o1")
+    p.add_argument("--layers", help="comma-separated layers (default: every eligible one)")
+    p.add_argument("--tolerance", type=float, default=1e-3,
+                   help="largest error allowed, relative to the largest logit")
+    p.add_argument("-o", "--output", default="conv_check.json")
+    add_evaluator_args(p)
+    args = parser.parse_args()
+    if not args.image:
+        parser.error("--image is required")
+
+    evaluator = evaluator_from_args(args)
+    evaluator.prepare()
+    layers = args.layers.split(",") if args.layers else None
+    if args.cmd == "check":
+        report = check(args.mode, args.pipeline, evaluator, layers, args.tolerance)
+        print("max error %.3g (%.3g relative), top-1 %s, top-5 overlap %d/5: %s" % (
+            report["max_abs_error"], report["max_rel_error"],
+            "same" if report["top1_match"] else "differs", report["top5_overlap"],
+            "OK" if report["ok"] else "FAILED"))
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=1)
+        print("Wrote %s" % args.output)
+        return 0 if report["ok"] else 1
+
+    rows = bench(args.mode, args.pipeline, evaluator, layers)
+    print_bench(args.mode, rows)
+    with open(args.output, "w") as f:
+        json.dump({"mode": args.mode, "pipeline": args.pipeline, "variants": rows}, f,
+                  indent=1)
+    print("Wrote %s" % args.output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+"""Static cost model over the generated LLVM IR.
+
+Features are read from the alexnet.ll / alexnet_opt.bc the scripts already
+emit (bitcode goes through llvm-dis): instruction and vector-instruction
+mix, FMA use, loop count and nest depth, loads and stores inside loops and
+in innermost loops, and allocation calls.  Loops are found from back edges
+in block layout order, which is how the MLIR lowering lays them out.
+
+A ridge regression from the features to log(latency) is fitted on search
+results that recorded both (the evaluator stores features for every
+candidate it compiles).  The search tools can then skip benchmarking
+candidates the model predicts to be clearly slower than the best measured
+so far.
+
+Usage:
+  python3 tools/cost_model.py features alexnet.ll alexnet_opt.bc
+  python3 tools/cost_model.py fit search_results.jsonl -o cost_model.json
+  python3 tools/cost_model.py predict cost_model.json alexnet_opt.bc
+"""
+
+import argparse
+import json
+import math
+import re
+import subprocess
+import sys
+
+VECTOR = re.compile(r"<(\d+) x (?:float|double|half|i\d+)>")
+LABEL_DEF = re.compile(r"^([\w.$-]+):")
+LABEL_USE = re.compile(r"label %([\w.$-]+)")
+OPCODE = re.compile(r"^\s+(?:%[\w.$-]+ = )?(?:tail |musttail |notail )?(\w+)")
+ALLOC = re.compile(r"@(malloc|aligned_alloc|posix_memalign|calloc|_mlir_memref_to_llvm_alloc)\(")
+FREE = re.compile(r"@(free|_mlir_memref_to_llvm_free)\(")
+
+FP_OPS = {"fadd", "fsub", "fmul", "fdiv", "fneg"}
+
+FEATURES = [
+    "instructions", "blocks", "loops", "max_loop_depth", "mean_loop_depth",
+    "loads", "stores", "loads_in_loops", "stores_in_loops", "innermost_mem_ops",
+    "innermost_mem_per_loop", "vector_ops", "vector_fp_ops", "vector_loads",
+    "vector_stores", "scalar_fp_ops", "fma_calls", "vector_fma_calls",
+    "shuffles", "max_vector_width", "alloc_calls", "free_calls", "alloc_in_loops",
+]
+
+
+def ir_lines(path):
+    """Lines of textual LLVM IR; bitcode is disassembled on the fly."""
+    if path.endswith(".bc"):
+        proc = subprocess.Popen(["llvm-dis", "-o", "-", path], stdout=subprocess.PIPE,
+                                text=True)
+        yield from proc.stdout
+        if proc.wait() != 0:
+            raise OSError("llvm-dis failed on %s" % path)
+    else:
+        with open(path) as f:
+            yield from f
+
+
+def _finish_function(blocks, stats):
+    """Loop features of one function; blocks are (label, instructions, targets)."""
+    index = {label: i for i, (label, _, _) in enumerate(blocks)}
+    loops = []
+    for i, (_, _, targets) in enumerate(blocks):
+        for target in targets:
+            head = index.get(target)
+            if head is not None and head <= i:
+                loops.append((head, i))
+    stats["loops"] += len(loops)
+    innermost = [(h, t) for h, t in loops
+                 if not any((h2, t2) != (h, t) and h <= h2 and t2 <= t for h2, t2 in loops)]
+    for i, (_, insts, _) in enumerate(blocks):
+        depth = sum(1 for h, t in loops if h <= i <= t)
+        stats["max_loop_depth"] = max(stats["max_loop_depth"], depth)
+        stats["_depth_weighted"] += depth * len(insts)
+        if depth == 0:
+            continue
+        in_innermost = any(h <= i <= t for h, t in innermost)
+        for op, line in insts:
+            if op == "load":
+                stats["loads_in_loops"] += 1
+            elif op == "store":
+                stats["stores_in_loops"] += 1
+            if in_innermost and op in ("load", "store"):
+                stats["innermost_mem_ops"] += 1
+            if op == "call" and ALLOC.search(line):
+                stats["alloc_in_loops"] += 1
+    stats["_innermost"] += len(innermost)
+
+
+def extract_features(path):
+    stats = dict.fromkeys(FEATURES, 0)
+    stats["_depth_weighted"] = stats["_innermost"] = 0
+    blocks = None
+    for line in ir_lines(path):
+        if line.startswith("define "):
+            blocks = [("", [], [])]
+            continue
+        if blocks is None:
+            continue
+        if line.startswith("}"):
+            _finish_function(blocks, stats)
+            blocks = None
+            continue
+        label = LABEL_DEF.match(line)
+        if label:
+            blocks.append((label.group(1), [], []))
+            stats["blocks"] += 1
+            continue
+        m = OPCODE.match(line)
+        if not m:
+            continue
+        op = m.group(1)
+        blocks[-1][1].append((op, line))
+        stats["instructions"] += 1
+        widths = [int(w) for w in VECTOR.findall(line)]
+        if widths:
+            stats["max_vector_width"] = max(stats["max_vector_width"], max(widths))
+        if op == "br" or op == "switch":
+            blocks[-1][2].extend(LABEL_USE.findall(line))
+        elif op == "load":
+            stats["loads"] += 1
+            stats["vector_loads"] += bool(widths)
+        elif op == "store":
+            stats["stores"] += 1
+            stats["vector_stores"] += bool(widths)
+        elif op in FP_OPS:
+            stats["vector_fp_ops" if widths else "scalar_fp_ops"] += 1
+        elif op == "shufflevector":
+            stats["shuffles"] += 1
+        elif op == "call":
+            if "@llvm.fma." in line or "@llvm.fmuladd." in line:
+                stats["vector_fma_calls" if widths else "fma_calls"] += 1
+            elif ALLOC.search(line):
+                stats["alloc_calls"] += 1
+            elif FREE.search(line):
+                stats["free_calls"] += 1
+        if widths:
+            stats["vector_ops"] += 1
+    if stats["instructions"]:
+        stats["mean_loop_depth"] = stats["_depth_weighted"] / stats["instructions"]
+    if stats["_innermost"]:
+        stats["innermost_mem_per_loop"] = stats["innermost_mem_ops"] / stats["_innermost"]
+    return {name: stats[name] for name in FEATURES}
+
+
+def _solve(a, b):
+    """Solve a x = b by Gaussian elimination with partial pivoting."""
+    n = len(b)
+    m = [row[:] + [b[i]] for i, row in enumerate(a)]
+    for col in range(n):
+        pivot = max(range(col, n), key=lambda r: abs(m[r][col]))
+        m[col], m[pivot] = m[pivot], m[col]
+        if abs(m[col][col]) < 1e-12:
+            continue
+        for r in range(n):
+            if r != col:
+                f = m[r][col] / m[col][col]
+                for c in range(col, n + 1):
+                    m[r][c] -= f * m[col][c]
+    return [m[i][n] / m[i][i] if abs(m[i][i]) > 1e-12 else 0.0 for i in range(n)]
+
+
+def _transform(value):
+    return math.log1p(max(value, 0.0))
+
+
+def fit(rows, l2=1.0):
+    """Ridge regression of log(latency) on log1p-scaled, standardized features."""
+    xs = [[_transform(r["features"].get(f, 0)) for f in FEATURES] for r in rows]
+    ys = [math.log(r["latency_ms"]) for r in rows]
+    n, k = len(xs), len(FEATURES)
+    mean = [sum(x[j] for x in xs) / n for j in range(k)]
+    std = [math.sqrt(sum((x[j] - mean[j]) ** 2 for x in xs) / n) or 1.0 for j in range(k)]
+    zs = [[(x[j] - mean[j]) / std[j] for j in range(k)] for x in xs]
+    ybar = sum(ys) / n
+    a = [[sum(z[i] * z[j] for z in zs) + (l2 if i == j else 0.0) for j in range(k)]
+         for i in range(k)]
+    b = [sum(z[i] * (y - ybar) for z, y in zip(zs, ys)) for i in range(k)]
+    weights = _solve(a, b)
+    return {"features": FEATURES, "mean": mean, "std": std,
+            "weights": weights, "bias": ybar, "l2": l2}
+
+
+def predict(model, features):
+    """Predicted latency in ms."""
+    z = sum(w * (_transform(features.get(f, 0)) - mu) / sd
+            for f, w, mu, sd in zip(model["features"], model["weights"],
+                                    model["mean"], model["std"]))
+    return math.exp(model["bias"] + z)
+
+
+def load_rows(paths):
+    rows = []
+    for path in paths:
+        with open(path) as f:
+            for line in f:
+                r = json.loads(line)
+                if r.get("status") == "ok" and r.get("latency_ms") and r.get("features"):
+                    rows.append(r)
+    return rows
+
+
+def rank_correlation(xs, ys):
+    def ranks(v):
+        order = sorted(range(len(v)), key=v.__getitem__)
+        out = [0] * len(v)
+        for rank, i in enumerate(order):
+            out[i] = rank
+        return out
+    rx, ry = ranks(xs), ranks(ys)
+    n = len(xs)
+    d = sum((a - b) ** 2 for a, b in zip(rx, ry))
+    return 1 - 6 * d / (n * (n * n - 1)) if n > 1 else 0.0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("features", help="print the features of .ll/.bc files")
+    p.add_argument("files", nargs="+")
+    p = sub.add_parser("fit", help="fit a model on search results logs")
+    p.add_argument("results", nargs="+")
+    p.add_argument("-o", "--output", default="cost_model.json")
+    p.add_argument("--l2", type=float, default=1.0)
+    p = sub.add_parser("predict", help="predict latency of .ll/.bc files")
+    p.add_argument("model")
+    p.add_argument("files", nargs="+")
+    args = parser.parse_args()
+
+    if args.cmd == "features":
+        for path in args.files:
+            print(json.dumps({"file": path, "features": extract_features(path)}))
+    elif args.cmd == "fit":
+        rows = load_rows(args.results)
+        if len(rows) < 3:
+            sys.exit("need at least 3 benchmarked candidates with features, got %d"
+                     % len(rows))
+        model = fit(rows, args.l2)
+        # Leave-one-out ranking quality: what pruning actually relies on.
+        loo = [predict(fit(rows[:i] + rows[i + 1:], args.l2), r["features"])
+               for i, r in enumerate(rows)]
+        print("%d candidates, leave-one-out rank correlation %.3f"
+              % (len(rows), rank_correlation(loo, [r["latency_ms"] for r in rows])))
+        with open(args.output, "w") as f:
+            json.dump(model, f, indent=1)
+        print("Wrote %s" % args.output)
+    else:
+        with open(args.model) as f:
+            model = json.load(f)
+        for path in args.files:
+            print("%-40s %10.3f ms" % (path, predict(model, extract_features(path))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,63 @@
+"""Write a candidate pipeline as a standalone script in the style of O1_pipeline.sh."""
+
+import os
+import shlex
+
+from pipelines import stage_label
+
+REPO_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+HEADER = '''#!/bin/bash
+
+# %s
+
+# --emit-bytecode and --text-stage N (inter-stage format) are handled by
+# scripts/common.sh.
+source %s "$@"
+set -- "${PIPELINE_ARGS[@]}"
+if [ $# -gt 0 ]; then
+  echo "Usage: $0 [--emit-bytecode] [--text-stage N]..."; exit 1
+fi
+'''
+
+
+def write_script(path, stages, backend, comment, input_ir="alexnet_linalg.mlir"):
+    """Emit stages 1..N as mlir-opt calls and the backend as stages 12-14."""
+    lines = [HEADER % (comment, shlex.quote(os.path.join(REPO_DIR, "scripts", "common.sh")))]
+    source = input_ir
+    for stage in stages:
+        base = os.path.splitext(stage.output)[0]
+        lines.append("# %s" % stage.title.rstrip("."))
+        lines.append('echo "%s"' % stage.title)
+        lines.append("mlir-opt %s \\" % source)
+        lines.extend("  %s \\" % flag for flag in stage.passes)
+        lines.append("  $BC_FLAGS \\")
+        lines.append("  -o %s.$EXT" % base)
+        lines.append("materialize_text %s %s" % (stage_label(stage), base))
+        lines.append("")
+        source = "%s.$EXT" % base
+
+    lines.append("# Stage 12: Translate to LLVM IR")
+    lines.append('echo "Stage 12: Translate to LLVM IR..."')
+    lines.append("mlir-translate --mlir-to-llvmir %s > %s" % (source, backend.ll))
+    lines.append("")
+
+    codegen_input = backend.ll
+    if backend.opt_passes:
+        lines.append("# Stage 13: LLVM optimizations")
+        lines.append('echo "Stage 13: LLVM optimization passes..."')
+        lines.append('opt -passes="%s" \\' % backend.opt_passes)
+        lines.append("  %s -o %s" % (backend.ll, backend.opt_output))
+        lines.append("")
+        codegen_input = backend.opt_output
+
+    lines.append("# Stage 14: Generate native code")
+    lines.append('echo "Stage 14: Generate native code..."')
+    for flags, output in backend.llc:
+        lines.append("llc %s %s -o %s" % (" ".join(shlex.quote(f) for f in flags),
+                                          codegen_input, output))
+    lines.append('echo "Compilation complete!"')
+
+    with open(path, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    os.chmod(path, 0o755)
@@ -0,0 +1,284 @@
+"""Compile and benchmark one candidate pipeline.
+
+A candidate is a stage list plus the backend (stages 12-14) of one of the
+scripts.  It is compiled by phase_driver.py in its own directory, linked
+against the benchmark driver (Optimized_Pipeline_1/main.c by default) and run
+on a test image.  The O1/O2 driver calls alexnet with bare pointers, or with
+memref descriptors when built with -DALEXNET_DYNAMIC_BATCH; candidates whose
+entry point has another ABI (the baseline returns its logits) fail before
+they are compiled instead of linking into a binary that crashes.  The result is a flat dict that the search tools append to
+their JSON-lines logs.
+"""
+
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import threading
+import time
+
+from cost_model import extract_features, predict
+from fingerprint import FingerprintIndex, combine
+from pipelines import BACKENDS, entry_abi, write_spec
+
+TOOLS_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(TOOLS_DIR)
+
+DEFAULT_DRIVER = os.path.join(REPO_DIR, "Optimized_Pipeline_1", "main.c")
+# Drivers whose alexnet ABI is known (see driver_abi); others are not checked.
+BENCHMARK_DRIVERS = (DEFAULT_DRIVER, os.path.join(REPO_DIR, "Optimized_Pipeline_2", "main.c"))
+DEFAULT_LIBS = ["-lmlir_c_runner_utils", "-lmlir_runner_utils", "-lm", "-fopenmp"]
+
+# Result fields that depend only on the generated code.
+MEASURED = ("text_bytes", "object_bytes", "latency_ms", "min_ms", "features")
+
+
+def text_size(obj):
+    """Size of .text in an object file, or None when binutils is missing."""
+    try:
+        out = subprocess.run(["size", "-A", obj], capture_output=True,
+                             text=True, check=True).stdout
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] == ".text":
+            return int(fields[1])
+    return None
+
+
+def parse_benchmark(output):
+    """Average and minimum latency (ms) from the benchmark driver's report."""
+    avg = re.search(r"Average:\s+([0-9.]+) ms", output)
+    low = re.search(r"Min:\s+([0-9.]+) ms", output)
+    if not avg:
+        return None, None
+    return float(avg.group(1)), float(low.group(1)) if low else None
+
+
+class Evaluator:
+    def __init__(self, input_ir, image, workroot, cache_dir=None,
+                 driver=DEFAULT_DRIVER, cc="clang", cflags=("-O3", "-march=native"),
+                 libs=DEFAULT_LIBS, warmup=3, runs=10, timeout=None, keep=False,
+                 bench_jobs=1, model=None, prune_margin=1.5, threads=None, link_extra=()):
+        self.input_ir = os.path.abspath(input_ir)
+        self.image = os.path.abspath(image) if image else None
+        self.workroot = os.path.abspath(workroot)
+        self.cache_dir = os.path.abspath(cache_dir) if cache_dir else None
+        self.driver = os.path.abspath(driver)
+        self.cc = cc
+        self.cflags = list(cflags)
+        self.libs = list(libs)
+        # Extra sources/objects for every link, e.g. the weight reservation
+        # (alexnet_weights.s) of an IR whose weights were externalized.
+        self.link_extra = [os.path.abspath(path) for path in link_extra]
+        self.warmup = warmup
+        self.runs = runs
+        self.timeout = timeout
+        self.keep = keep
+        self.driver_obj = None
+        # Compiles run on every worker; timing runs are limited separately so
+        # that concurrent benchmarks do not skew each other's latency.
+        self.bench_slots = threading.BoundedSemaphore(bench_jobs)
+        # Results are reused by IR fingerprint, but only between evaluations
+        # that measure the same way.
+        self.threads = threads
+        self.fp_dir = None
+        if self.cache_dir:
+            setup = [str(self.image), self.driver, self.cc, " ".join(self.cflags),
+                     " ".join(self.libs), str(self.warmup), str(self.runs)]
+            if threads:
+                setup.append("threads=%d" % threads)
+            setup += self.link_extra
+            setup = combine(*setup)
+            self.fp_dir = os.path.join(self.cache_dir, "fingerprints", setup[:16])
+        self.fp_index = FingerprintIndex(self.fp_dir) if self.fp_dir else None
+        # Cost-model pruning: skip the benchmark of candidates predicted to be
+        # more than prune_margin times slower than the best measured so far.
+        self.model = model
+        self.prune_margin = prune_margin
+        self.best_ms = None
+        self.lock = threading.Lock()
+
+    def prepare(self):
+        """Compile the benchmark driver once; every candidate only links it."""
+        os.makedirs(self.workroot, exist_ok=True)
+        self.driver_obj = os.path.join(self.workroot, "driver.o")
+        subprocess.run([self.cc] + self.cflags + ["-fopenmp", "-c", self.driver,
+                        "-I", os.path.dirname(self.driver), "-o", self.driver_obj],
+                       check=True)
+
+    def driver_abi(self):
+        """entry_abi() the benchmark driver calls, or None when unknown."""
+        if self.driver not in BENCHMARK_DRIVERS:
+            return None
+        return "descriptor" if "-DALEXNET_DYNAMIC_BATCH" in self.cflags else "bare"
+
+    def check_abi(self, stages):
+        """Raise ValueError when `stages` build an alexnet the driver cannot call."""
+        expected, abi = self.driver_abi(), entry_abi(stages)
+        if expected and abi != expected:
+            raise ValueError("alexnet has the %s ABI, but %s calls it with the %s ABI"
+                             % (abi, os.path.relpath(self.driver, REPO_DIR), expected))
+
+    def compile(self, workdir, stages, backend, opt_passes=None, dedup=True):
+        """Run the driver on a candidate; returns the object file to link.
+
+        Returns None when the driver found that the IR matches an earlier
+        candidate whose result is recorded (see dedup.json).  With dedup=False
+        the object file is always built.
+        """
+        self.check_abi(stages)
+        spec = os.path.join(workdir, "candidate.json")
+        write_spec(spec, stages, backend, opt_passes)
+        cmd = [sys.executable, os.path.join(TOOLS_DIR, "phase_driver.py"),
+               "--spec", spec, "-i", self.input_ir, "-C", workdir, "--emit-bytecode"]
+        if self.cache_dir:
+            cmd += ["--cache-dir", self.cache_dir]
+            if dedup:
+                cmd += ["--fingerprints", self.fp_dir]
+        with open(os.path.join(workdir, "compile.log"), "w") as log:
+            subprocess.run(cmd, stdout=log, stderr=subprocess.STDOUT,
+                           timeout=self.timeout, check=True)
+        if os.path.exists(os.path.join(workdir, "dedup.json")):
+            return None
+
+        codegen = BACKENDS[backend].llc[-1][1]
+        if codegen.endswith(".o"):
+            return os.path.join(workdir, codegen)
+        obj = os.path.join(workdir, os.path.splitext(codegen)[0] + ".o")
+        subprocess.run([self.cc, "-c", os.path.join(workdir, codegen), "-o", obj],
+                       check=True)
+        return obj
+
+    def final_ir(self, workdir, backend, opt_passes):
+        """The LLVM IR llc consumes: opt's bitcode, or the .ll without opt."""
+        base = BACKENDS[backend]
+        if opt_passes is not None:
+            base = base._replace(opt_passes=opt_passes)
+        return os.path.join(workdir, base.opt_output if base.opt_passes else base.ll)
+
+    def pruned(self, result):
+        if not (self.model and self.image):
+            return False
+        result["predicted_ms"] = round(predict(self.model, result["features"]), 3)
+        with self.lock:
+            best = self.best_ms
+        return best is not None and result["predicted_ms"] > self.prune_margin * best
+
+    def final_fingerprint(self, workdir):
+        for name in ("dedup.json", "fingerprints.json"):
+            path = os.path.join(workdir, name)
+            if os.path.exists(path):
+                with open(path) as f:
+                    return json.load(f)["final"]
+        return None
+
+    def link(self, workdir, obj):
+        binary = os.path.join(workdir, "alexnet_infer")
+        subprocess.run([self.cc] + self.cflags + [self.driver_obj, obj] + self.link_extra
+                       + self.libs + ["-no-pie", "-o", binary], check=True)
+        return binary
+
+    def run(self, binary, threads=None, env=None):
+        """(average, min) latency in ms; `threads` overrides the OpenMP default."""
+        cmd = [binary, self.image, str(self.warmup), str(self.runs)]
+        if threads:
+            cmd.append(str(threads))
+        with self.bench_slots:
+            out = subprocess.run(cmd, capture_output=True, text=True, timeout=self.timeout,
+                                 cwd=os.path.dirname(self.driver), check=True,
+                                 env=dict(os.environ, **env) if env else None).stdout
+        return parse_benchmark(out)
+
+    def benchmark(self, workdir, obj):
+        return self.run(self.link(workdir, obj), self.threads)
+
+    def evaluate(self, name, stages, backend, opt_passes=None):
+        """Compile and (when an image is set) benchmark one candidate."""
+        workdir = os.path.join(self.workroot, name)
+        # Start clean: a directory kept from a failed run may hold a stale dedup.json.
+        shutil.rmtree(workdir, ignore_errors=True)
+        os.makedirs(workdir)
+        result = {"name": name, "status": "ok"}
+        try:
+            start = time.perf_counter()
+            obj = self.compile(workdir, stages, backend, opt_passes)
+            result["compile_s"] = round(time.perf_counter() - start, 3)
+            final = self.final_fingerprint(workdir)
+            prior = self.fp_index.result(final) if final else None
+            if obj is None and prior is None:
+                raise OSError("driver reported a duplicate with no recorded result")
+            if prior is not None:
+                # Identical IR was compiled and measured before.
+                result.update({k: prior.get(k) for k in MEASURED})
+                result["duplicate_of"] = prior["name"]
+            else:
+                result["text_bytes"] = text_size(obj)
+                result["object_bytes"] = os.path.getsize(obj)
+                result["features"] = extract_features(
+                    self.final_ir(workdir, backend, opt_passes))
+                if self.pruned(result):
+                    result["status"] = "pruned"
+                elif self.image:
+                    result["latency_ms"], result["min_ms"] = self.benchmark(workdir, obj)
+                    if result["latency_ms"] is None:
+                        result["status"] = "failed"
+                        result["error"] = "no latency in benchmark output"
+                    else:
+                        with self.lock:
+                            if self.best_ms is None or result["latency_ms"] < self.best_ms:
+                                self.best_ms = result["latency_ms"]
+                if final and result["status"] == "ok":
+                    self.fp_index.store_result(final, result)
+        except subprocess.TimeoutExpired:
+            result["status"] = "timeout"
+        except (OSError, ValueError, subprocess.CalledProcessError) as err:
+            result["status"] = "failed"
+            result["error"] = str(err)
+        # Failed candidates keep their directory (compile.log) for inspection.
+        if result["status"] in ("ok", "pruned") and not self.keep:
+            shutil.rmtree(workdir, ignore_errors=True)
+        return result
+
+
+def add_evaluator_args(parser):
+    """Command-line options shared by the search tools."""
+    parser.add_argument("-i", "--input", default="alexnet_linalg.mlir")
+    parser.add_argument("--image", help="benchmark image; compile only when omitted")
+    parser.add_argument("--workdir", default="search_runs",
+                        help="per-candidate build directories")
+    parser.add_argument("--cache-dir", default=os.path.expanduser("~/.cache/phase_ordering"),
+                        help="stage cache shared by all candidates")
+    parser.add_argument("--driver", default=DEFAULT_DRIVER,
+                        help="benchmark main.c the candidates are linked with")
+    parser.add_argument("--cc", default="clang")
+    parser.add_argument("--warmup", type=int, default=3)
+    parser.add_argument("--runs", type=int, default=10)
+    parser.add_argument("--timeout", type=float, help="per-candidate limit in seconds")
+    parser.add_argument("--threads", type=int,
+                        help="OpenMP threads for the -parallel pipelines "
+                             "(default: OMP_NUM_THREADS or all cores)")
+    parser.add_argument("--link", action="append", default=[], metavar="FILE",
+                        help="extra source or object linked into every candidate "
+                             "(repeatable), e.g. alexnet_weights.s")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep build directories of successful candidates")
+    parser.add_argument("--model", help="cost model (tools/cost_model.py fit) used to "
+                                        "skip benchmarks of predicted-slow candidates")
+    parser.add_argument("--prune-margin", type=float, default=1.5,
+                        help="skip when predicted latency exceeds this times the best")
+
+
+def evaluator_from_args(args, bench_jobs=1):
+    model = None
+    if args.model:
+        with open(args.model) as f:
+            model = json.load(f)
+    return Evaluator(args.input, args.image, args.workdir, cache_dir=args.cache_dir,
+                     driver=args.driver, cc=args.cc, warmup=args.warmup,
+                     runs=args.runs, timeout=args.timeout, keep=args.keep,
+                     bench_jobs=bench_jobs, model=model, prune_margin=args.prune_margin,
+                     threads=args.threads, link_extra=args.link)
@@ -0,0 +1,109 @@
+"""Structural fingerprints of the IR and an index of results keyed by them.
+
+Different orderings often produce identical IR after some stage (a repeated
+--canonicalize, a stage that finds nothing to do).  Everything downstream of
+that point is then identical as well, so the compile and benchmark result of
+the first candidate can be reused.
+
+- module_fingerprint() hashes the generic-form print of an MLIR module without
+  locations, so only structure, types and attribute values count.  Large
+  resource blobs (the weights) are elided from the print; each is hashed once
+  per handle and its digest is mixed in by handle.  Handles are unique within
+  a context, so the digests can be kept across the stages of one module.
+- llvm_ir_fingerprint() hashes an .ll file without the lines that name the
+  file it came from.
+- FingerprintIndex maps (stage fingerprint, remaining pipeline) to the final
+  fingerprint it led to, and final fingerprints to their measured results.
+"""
+
+import hashlib
+import io
+import json
+import os
+import re
+
+RESOURCE = re.compile(r"dense_resource<([^>]+)>")
+# Blobs up to this size are printed (and hashed) inline.
+INLINE_RESOURCE_BYTES = 64
+
+
+class _HashWriter:
+    def __init__(self):
+        self.hash = hashlib.sha256()
+
+    def write(self, text):
+        self.hash.update(text.encode() if isinstance(text, str) else text)
+
+
+def module_fingerprint(module, blob_digests=None):
+    """Fingerprint of `module`; `blob_digests` caches {handle: blob digest}."""
+    from weights import resource_blobs
+
+    text = io.StringIO()
+    module.operation.print(file=text, print_generic_op_form=True, enable_debug_info=False,
+                           large_resource_limit=INLINE_RESOURCE_BYTES)
+    text = text.getvalue()
+    blob_digests = {} if blob_digests is None else blob_digests
+    handles = sorted(set(RESOURCE.findall(text)))
+    if any(h not in blob_digests for h in handles):
+        for handle, blob in resource_blobs(module).items():
+            blob_digests.setdefault(handle, hashlib.sha256(blob).hexdigest())
+    writer = _HashWriter()
+    writer.write(text)
+    for handle in handles:
+        writer.write("\0%s=%s" % (handle, blob_digests.get(handle, "")))
+    return writer.hash.hexdigest()
+
+
+def llvm_ir_fingerprint(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        for line in f:
+            if line.startswith(b"; ModuleID") or line.startswith(b"source_filename"):
+                continue
+            h.update(line)
+    return h.hexdigest()
+
+
+def combine(*parts):
+    return hashlib.sha256("\0".join(parts).encode()).hexdigest()
+
+
+def backend_key(backend):
+    """Everything after mlir-translate that shapes the generated code."""
+    return json.dumps([backend.opt_passes or "", backend.llc], sort_keys=True)
+
+
+class FingerprintIndex:
+    def __init__(self, root):
+        self.root = root
+
+    def _path(self, kind, key, ext=""):
+        return os.path.join(self.root, kind, key[:2], key + ext)
+
+    def _write(self, path, text):
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        tmp = "%s.%d.tmp" % (path, os.getpid())
+        with open(tmp, "w") as f:
+            f.write(text)
+        os.replace(tmp, path)
+
+    def final_for(self, stage_key):
+        path = self._path("stages", stage_key)
+        if os.path.exists(path):
+            with open(path) as f:
+                return f.read().strip()
+        return None
+
+    def record_stage(self, stage_key, final):
+        self._write(self._path("stages", stage_key), final + "\n")
+
+    def result(self, final):
+        path = self._path("results", final, ".json")
+        if os.path.exists(path):
+            with open(path) as f:
+                return json.load(f)
+        return None
+
+    def store_result(self, final, result):
+        self._write(self._path("results", final, ".json"), json.dumps(result))
@@ -0,0 +1,421 @@
+#!/usr/bin/env python3
+"""Tile-and-fuse of each convolution with its bias, ReLU and max-pool.
+
+After Stage 1 a conv layer is a chain of separate ops, each of which writes
+the whole conv output before the next one reads it:
+
+  bias broadcast -> linalg.conv_2d_nchw_fchw -> ReLU generic -> linalg.pooling_nchw_max
+
+(conv3 and conv4 have no pool).  --fuse-conv tiles the last op of each
+chain over output channels (and optionally output rows) with scf.for.  It
+then fuses the ReLU, the convolution and the bias broadcast into that loop
+with transform.structured.fuse_into_containing_op.  Each tile then computes
+`channels` channels of the conv output, adds the bias, applies ReLU and
+pools them while they are still in cache.  The full conv output is never
+materialized.  Tiling rows as well (rows=N, in pooled rows for pooled
+layers) makes the tiles smaller, but conv rows on the pool window's halo
+are computed twice.
+
+After --layout nhwc the chain is linalg.conv_2d_nhwc_fhwc ->
+linalg.pooling_nhwc_max, and the tiles cover the channels of (rows of) the
+NHWC output instead.
+
+The step runs at the start of the stage after Stage 1, after any conv
+rewrite and the layout step.  Layers rewritten by --im2col, --winograd or
+--pack-weights no longer have a named convolution and are left alone; the
+others keep their names (see named_layers).  `traffic` estimates,
+per layer, the activation bytes moved through memory with and without
+fusion, from the shapes alone (see fused_traffic).  `bench` measures the
+latency of each fused layer and, with --perf, the last-level cache misses
+of each build under `perf stat`, as bytes per inference.
+
+Usage:
+  python3 tools/phase_driver.py -p o1 --fuse-conv
+  python3 tools/phase_driver.py -p o1 --fuse-conv conv1,conv2 --fuse-channels 8
+  python3 tools/fusion.py traffic -p o1 -i alexnet_linalg.mlir
+  python3 tools/fusion.py bench -p o1 --image cat.jpg --perf
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+from conv_rewrite import (CANONICALIZE, NHWC_CONV, REWRITES, conv_flag, named_layers,
+                          print_bench, with_conv_step)
+from layout import LAYOUT_PASS
+from pipelines import PIPELINES, parse_pass_flag, stage_label
+from tiling import apply_transform, cache_sizes, match_tagged
+
+FUSE_PASS = "fuse-conv"
+TAG = "fuse_conv"
+POOLS = ("linalg.pooling_nchw_max", "linalg.pooling_nhwc_max")
+# 16 output channels: conv1's tile (16x55x55 floats, 190 KB) fits in L2.
+DEFAULT_CHANNELS = 16
+# Counted by `bench --perf`; each miss moves one cache line.
+PERF_EVENTS = ("LLC-load-misses", "LLC-store-misses")
+CACHE_LINE = 64
+# Steps whose flags must run before the fusion step.
+BEFORE_FUSION = REWRITES + (LAYOUT_PASS,)
+
+
+def _user(value):
+    """The only op using `value`, or None."""
+    uses = list(value.uses)
+    return uses[0].owner.operation if len(uses) == 1 else None
+
+
+def _elementwise(op):
+    from mlir.ir import ArrayAttr
+
+    if op is None or op.name != "linalg.generic":
+        return False
+    iterators = ArrayAttr(op.attributes["iterator_types"])
+    return all("parallel" in str(it) for it in iterators)
+
+
+def chains(module):
+    """[{name, conv, bias, epilogue, pool}] of the named convolutions.
+
+    bias is the linalg op that initializes the conv output, epilogue the
+    elementwise op reading it (ReLU) and pool the max-pool reading that;
+    each is None when the layer does not have one.
+    """
+    out = []
+    for name, op in named_layers(module):
+        if not name.startswith("conv"):
+            continue
+        op = op.operation
+        init = op.operands[2].owner
+        bias = init.operation if hasattr(init, "operation") else None
+        if bias is not None and not bias.name.startswith("linalg."):
+            bias = None
+        epilogue = _user(op.results[0])
+        if not _elementwise(epilogue):
+            epilogue = None
+        pool = _user(epilogue.results[0]) if epilogue is not None else None
+        if pool is not None and pool.name not in POOLS:
+            pool = None
+        out.append({"name": name, "conv": op, "bias": bias, "epilogue": epilogue,
+                    "pool": pool})
+    return out
+
+
+def _selected(module, names):
+    found = {c["name"]: c for c in chains(module)}
+    missing = [name for name in names or [] if name not in found]
+    if missing:
+        raise ValueError("no convolution named %s in this module" % ", ".join(missing))
+    return [c for name, c in sorted(found.items()) if not names or name in names]
+
+
+def _fuse_body(n, chain, channels, rows):
+    """Transform lines that tile the last op of `chain` and fuse the rest into it."""
+    name = chain["name"]
+    ops = [(role, chain[role]) for role in ("pool", "epilogue", "conv", "bias") if chain[role]]
+    # Parallel loops: (n, c, h, ...) in NCHW, (n, h, w, c) after --propagate-layout.
+    if chain["conv"].name == NHWC_CONV:
+        sizes = [0, rows, 0, channels]
+    else:
+        sizes = [0, channels] + ([rows] if rows else [])
+    loops = sum(1 for s in sizes if s)
+    body = [match_tagged("%%last%d" % n, "%s_%s" % (name, ops[0][0]), TAG),
+            "%%tiled%d, %%loops%d%s = transform.structured.tile_using_for %%last%d "
+            "tile_sizes [%s] : (!transform.any_op) -> (%s)"
+            % (n, n, ":%d" % loops if loops > 1 else "", n, ", ".join(map(str, sizes)),
+               ", ".join(["!transform.any_op"] * (loops + 1)))]
+    # Producers go into the innermost loop, consumer first.
+    loop = "%%loops%d%s" % (n, "#%d" % (loops - 1) if loops > 1 else "")
+    for k, (role, _) in enumerate(ops[1:]):
+        body.append(match_tagged("%%%s%d" % (role, n), "%s_%s" % (name, role), TAG))
+        body.append("%%fused_%s%d, %%loop%d_%d = transform.structured.fuse_into_containing_op "
+                    "%%%s%d into %s : (!transform.any_op, !transform.any_op) "
+                    "-> (!transform.any_op, !transform.any_op)"
+                    % (role, n, n, k, role, n, loop))
+        loop = "%%loop%d_%d" % (n, k)
+    return body
+
+
+def fuse_pass(module, options):
+    """Driver implementation of --fuse-conv."""
+    names = [key for key, value in options if value is None]
+    values = dict(options)
+    channels = int(values.get("channels") or DEFAULT_CHANNELS)
+    rows = int(values.get("rows") or 0)
+    body, tagged = [], {}
+    for n, chain in enumerate(_selected(module, names)):
+        if chain["epilogue"] is None and chain["pool"] is None:
+            continue
+        for role in ("conv", "bias", "epilogue", "pool"):
+            if chain[role] is not None:
+                tagged["%s_%s" % (chain["name"], role)] = chain[role]
+        body += _fuse_body(n, chain, channels, rows)
+    if body:
+        apply_transform(module, body + CANONICALIZE, tagged, TAG)
+
+
+def with_fusion_step(stages, flag):
+    """with_conv_step(), keeping the fusion after the conv rewrites of that stage."""
+    out = with_conv_step(stages, flag)
+    for n, stage in enumerate(out):
+        if flag not in stage.passes:
+            continue
+        passes = [p for p in stage.passes if p != flag]
+        i = 0
+        while i < len(passes) and parse_pass_flag(passes[i])[0] in BEFORE_FUSION:
+            i += 1
+        passes.insert(i, flag)
+        out[n] = stage._replace(passes=passes)
+    return out
+
+
+def fusion_flag(layers, channels=None, rows=None):
+    extra = []
+    if channels:
+        extra.append("channels=%d" % channels)
+    if rows:
+        extra.append("rows=%d" % rows)
+    return conv_flag(FUSE_PASS, layers, extra)
+
+
+# -- Activation traffic -----------------------------------------------------------
+
+def _bytes(value):
+    from mlir.ir import ShapedType
+
+    shaped = ShapedType(value.type)
+    return shaped.get_number_of_elements() * shaped.element_type.width // 8
+
+
+def _strides(op):
+    from mlir.ir import DenseIntElementsAttr
+
+    return [int(v) for v in DenseIntElementsAttr(op.attributes["strides"])]
+
+
+def _geometry(chain):
+    """Sizes and row geometry of one chain, as fused_traffic() takes them."""
+    from mlir.ir import ShapedType
+
+    conv, pool = chain["conv"], chain["pool"]
+    nhwc = conv.name == NHWC_CONV
+    in_shape = list(ShapedType(conv.operands[0].type).shape)
+    out_shape = list(ShapedType(conv.results[0].type).shape)
+    filt = list(ShapedType(conv.operands[1].type).shape)
+    g = {"shape": out_shape, "input_bytes": _bytes(conv.operands[0]),
+         "conv_bytes": _bytes(conv.results[0]),
+         "output_bytes": _bytes(pool.results[0] if pool is not None else conv.results[0]),
+         "channels": out_shape[3] if nhwc else out_shape[1],
+         "input_rows": in_shape[1] if nhwc else in_shape[2],
+         "conv_rows": out_shape[1] if nhwc else out_shape[2],
+         "kernel": filt[1] if nhwc else filt[2], "stride": _strides(conv)[0],
+         "pool_kernel": 1, "pool_stride": 1, "pool_rows": out_shape[1] if nhwc else out_shape[2]}
+    if pool is not None:
+        window = ShapedType(pool.operands[1].type).shape
+        pooled = ShapedType(pool.results[0].type).shape
+        g.update(pool_kernel=window[0], pool_stride=_strides(pool)[0],
+                 pool_rows=pooled[1] if nhwc else pooled[2])
+    return g
+
+
+def fused_traffic(g, channels, rows, cache, fusible=True):
+    """Estimated bytes one layer moves through memory, unfused and fused.
+
+    Unfused, the conv reads its input (I) once, and the conv output (S) is
+    written by the bias broadcast, read and written by the convolution, read
+    and written by ReLU and read by the pool, which writes the layer output
+    (O): I + 6S + O, or I + 4S without a pool (ReLU writes the output).
+
+    Fused, a tile of `channels` channels (and `rows` pooled rows) stays in
+    cache between the ops if two tiles fit, and only the input and O move:
+    - with row tiles, each tile recomputes the conv rows under the pool
+      window's halo and reads the input rows under those (halo_bytes);
+    - every channel tile reads all input channels, so the input is read once
+      per channel tile unless it fits in cache next to two tiles.
+    Weights and any spill of a tile that does not fit are not modelled.
+    """
+    S, C = g["conv_bytes"], g["channels"]
+    if g["pool_kernel"] > 1:
+        unfused = g["input_bytes"] + 6 * S + g["output_bytes"]
+    else:
+        unfused = g["input_bytes"] + 4 * S
+    channel_tiles = -(-C // min(channels, C))
+    row_tiles, tile_rows, input_rows = 1, g["conv_rows"], g["input_rows"]
+    if rows and rows < g["pool_rows"]:
+        row_tiles = -(-g["pool_rows"] // rows)
+        tile_rows = min((rows - 1) * g["pool_stride"] + g["pool_kernel"], g["conv_rows"])
+        input_rows = row_tiles * min((tile_rows - 1) * g["stride"] + g["kernel"],
+                                     g["input_rows"])
+    tile = S * min(channels, C) // C * tile_rows // g["conv_rows"]
+    input_read = g["input_bytes"] * input_rows // g["input_rows"]
+    if input_read // row_tiles + 2 * tile > cache:
+        input_read *= channel_tiles
+    out = {"tile_bytes": tile, "unfused_bytes": unfused,
+           "halo_bytes": g["input_bytes"] * (input_rows - g["input_rows"]) // g["input_rows"],
+           "recomputed_rows": max(row_tiles * tile_rows - g["conv_rows"], 0)}
+    if fusible and 2 * tile <= cache:
+        out["fused_bytes"] = input_read + g["output_bytes"]
+    else:
+        out["fused_bytes"] = unfused
+    return out
+
+
+def traffic(module, channels=DEFAULT_CHANNELS, rows=0, cache=None):
+    """Estimated activation traffic per layer; see fused_traffic()."""
+    cache = cache or cache_sizes().get("L2", 1 << 20)
+    out = []
+    for chain in chains(module):
+        g = _geometry(chain)
+        row = {"layer": chain["name"], "conv_output": g["shape"],
+               "conv_output_bytes": g["conv_bytes"], "pool": chain["pool"] is not None}
+        row.update(fused_traffic(g, channels, rows, cache, chain["epilogue"] is not None))
+        out.append(row)
+    return out
+
+
+def print_traffic(rows):
+    mb = 2.0 ** 20
+    print("Estimated activation bytes per layer (a model, not a measurement):")
+    print("%-6s %-16s %5s %10s %12s %12s %10s %9s" % ("layer", "conv output", "pool", "tile",
+                                                      "unfused", "fused", "halo", "saved"))
+    for r in rows:
+        print("%-6s %-16s %5s %7.0f KB %9.2f MB %9.2f MB %7.0f KB %8.0f%%" % (
+            r["layer"], "x".join(map(str, r["conv_output"])), "yes" if r["pool"] else "no",
+            r["tile_bytes"] / 1024.0, r["unfused_bytes"] / mb, r["fused_bytes"] / mb,
+            r["halo_bytes"] / 1024.0,
+            100.0 * (1 - r["fused_bytes"] / r["unfused_bytes"]) if r["unfused_bytes"] else 0))
+    total = sum(r["unfused_bytes"] for r in rows)
+    fused = sum(r["fused_bytes"] for r in rows)
+    print("%-6s %-16s %5s %10s %9.2f MB %9.2f MB" % ("total", "", "", "", total / mb, fused / mb))
+
+
+# -- Per-layer benchmark -------------------------------------------------------------
+
+def miss_bytes(evaluator, binary):
+    """LLC miss bytes per inference of `binary`, counted by perf stat.
+
+    perf counts the whole process, so loading the weights and the image is
+    spread over the warmup and timed runs; compare builds, not layers.
+    """
+    runs = evaluator.warmup + evaluator.runs
+    cmd = ["perf", "stat", "-x", ",", "-e", ",".join(PERF_EVENTS), "--",
+           binary, evaluator.image, str(evaluator.warmup), str(evaluator.runs)]
+    with evaluator.bench_slots:
+        err = subprocess.run(cmd, capture_output=True, text=True, timeout=evaluator.timeout,
+                             cwd=os.path.dirname(evaluator.driver), check=True).stderr
+    counts = {}
+    for line in err.splitlines():
+        fields = line.split(",")
+        # value,unit,event,...; the event may carry a :u modifier.
+        if len(fields) > 2 and fields[2].split(":")[0] in PERF_EVENTS:
+            if not fields[0].isdigit():
+                raise ValueError("perf could not count %s: %s" % (fields[2], fields[0]))
+            counts[fields[2]] = int(fields[0])
+    if len(counts) != len(PERF_EVENTS):
+        raise ValueError("no %s in perf stat output" % ", ".join(PERF_EVENTS))
+    return sum(counts.values()) * CACHE_LINE // runs
+
+
+def bench(pipeline, evaluator, layers, channels=None, rows=None, perf=False):
+    stages = PIPELINES[pipeline]
+    variants = [("direct", stages)]
+    variants += [(layer, with_fusion_step(stages, fusion_flag([layer], channels, rows)))
+                 for layer in layers]
+    variants.append(("all", with_fusion_step(stages, fusion_flag(layers, channels, rows))))
+    if perf:
+        # Keep the build directories for the binaries perf runs.
+        evaluator.keep = True
+    out = []
+    for label, candidate in variants:
+        name = "fuse_%s_%s" % (pipeline, label)
+        result = evaluator.evaluate(name, candidate, pipeline)
+        result["variant"] = label
+        binary = os.path.join(evaluator.workroot, name, "alexnet_infer")
+        if perf and result["status"] == "ok" and os.path.exists(binary):
+            try:
+                result["llc_miss_bytes"] = miss_bytes(evaluator, binary)
+            except (OSError, ValueError, subprocess.SubprocessError) as err:
+                result["perf_error"] = str(err)
+        out.append(result)
+        print("  %s: %s%s" % (label, "%.3f ms" % result["latency_ms"]
+                              if result.get("latency_ms") else result["status"],
+                              ", %.2f MB LLC misses/inference" % (
+                                  result["llc_miss_bytes"] / 2.0 ** 20)
+                              if "llc_miss_bytes" in result else ""))
+    return out
+
+
+def print_misses(rows):
+    """Measured miss traffic of each build, next to the direct build's."""
+    direct = rows[0].get("llc_miss_bytes")
+    mb = 2.0 ** 20
+    print("\nMeasured LLC miss bytes per inference (perf stat, whole process):")
+    print("%-8s %12s %12s" % ("variant", "misses", "change"))
+    for r in rows:
+        if "llc_miss_bytes" not in r:
+            print("%-8s %12s" % (r["variant"], r.get("perf_error", r["status"])))
+            continue
+        print("%-8s %9.2f MB %9.2f MB" % (
+            r["variant"], r["llc_miss_bytes"] / mb,
+            (r["llc_miss_bytes"] - direct) / mb if direct is not None else 0.0))
+
+
+# -- Command line -------------------------------------------------------------------
+
+def main():
+    from evaluate import add_evaluator_args, evaluator_from_args
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("traffic", help="estimated activation traffic per layer")
+    p.add_argument("-p", "--pipeline", choices=sorted(PIPELINES), default="o1")
+    p.add_argument("-i", "--input", default="alexnet_linalg.mlir")
+    p.add_argument("--channels", type=int, default=DEFAULT_CHANNELS)
+    p.add_argument("--rows", type=int, default=0, help="pooled rows per tile (0: all)")
+    p.add_argument("-o", "--output", default="fusion_traffic.json")
+    p = sub.add_parser("bench", help="latency with each layer fused and with all fused")
+    p.add_argument("-p", "--pipeline", choices=sorted(PIPELINES), default="o1")
+    p.add_argument("--layers", default="conv1,conv2,conv3,conv4,conv5")
+    p.add_argument("--channels", type=int)
+    p.add_argument("--rows", type=int)
+    p.add_argument("--perf", action="store_true",
+                   help="also count LLC misses of each build with perf stat")
+    p.add_argument("-o", "--output", default="fusion_bench.json")
+    add_evaluator_args(p)
+    args = parser.parse_args()
+
+    if args.cmd == "traffic":
+        from mlir.ir import Context
+        from phase_driver import load_module, run_passes
+
+        with Context():
+            module = load_module(args.input)
+            for stage in PIPELINES[args.pipeline]:
+                run_passes(module, stage.passes)
+                if stage_label(stage) == "1":
+                    break
+            rows = traffic(module, args.channels, args.rows)
+        print_traffic(rows)
+        with open(args.output, "w") as f:
+            json.dump(rows, f, indent=1)
+        print("Wrote %s" % args.output)
+        return 0
+
+    if not args.image:
+        parser.error("--image is required")
+    evaluator = evaluator_from_args(args)
+    evaluator.prepare()
+    rows = bench(args.pipeline, evaluator, args.layers.split(","), args.channels, args.rows,
+                 args.perf)
+    print_bench("fuse", rows)
+    if args.perf:
+        print_misses(rows)
+    with open(args.output, "w") as f:
+        json.dump({"pipeline": args.pipeline, "variants": rows}, f, indent=1)
+    print("Wrote %s" % args.output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
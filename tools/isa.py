@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+"""One model object with SSE4.2, AVX2 and AVX-512 code, picked at load time.
+
+Stages 13-14 of O1/O2 run opt and then llc -mcpu=native -mattr=+avx2,..., so
+alexnet.o only runs on CPUs like the build host's.  With --isa-variants,
+the LLVM IR of Stage 12 is instead optimized and compiled once per ISA
+level, and each object gets its own entry point:
+
+  sse4.2  -mcpu=x86-64-v2  alexnet_sse42
+  avx2    -mcpu=x86-64-v3  alexnet_avx2    (AVX2, FMA, F16C, BMI1/2, LZCNT, MOVBE)
+  avx512  -mcpu=x86-64-v4  alexnet_avx512  (AVX-512 F/BW/CD/DQ/VL)
+  generic -mcpu=x86-64     alexnet_generic (SSE2, on request)
+
+opt also gets the CPU, so the vectorizer picks vector widths for each
+level.  A generated alexnet_isa.c defines `alexnet` as a GNU indirect
+function.  Its resolver runs once at load time, checks the CPU with
+__builtin_cpu_supports("x86-64-vN") (cpuid), which tests every feature of the
+level llc compiled for, and binds `alexnet` to the best variant the
+CPU supports, or to the lowest one.  The call itself is not wrapped, so the
+variants can have any signature: bare-pointer or descriptor ABI.
+`alexnet_isa()` returns the name of the chosen variant, and main.c prints
+it.  Everything is linked with ld -r into one alexnet.o, so the link command
+does not change.
+
+Every variant has its own copy of any weights in the IR; externalized
+weights (--external-weights) are shared.
+
+Usage:
+  python3 tools/phase_driver.py -p o1 --isa-variants
+  python3 tools/phase_driver.py -p o2 --isa-variants avx2,avx512
+  python3 tools/isa.py build -i alexnet.ll --opt-passes "loop-vectorize" --llc-flags "-O3" -o alexnet.o
+"""
+
+import argparse
+import os
+import shlex
+import subprocess
+import sys
+
+ENTRY = "alexnet"
+# name -> (LLVM CPU, features the resolver checks), lowest level first.  The
+# checks name the whole micro-architecture level (GCC 12, Clang 17), since
+# code built for a level may use any of its features, not just the vector ones.
+ISAS = {
+    "generic": ("x86-64", []),
+    "sse4.2": ("x86-64-v2", ["x86-64-v2"]),
+    "avx2": ("x86-64-v3", ["x86-64-v3"]),
+    "avx512": ("x86-64-v4", ["x86-64-v4"]),
+}
+DEFAULT_VARIANTS = ("sse4.2", "avx2", "avx512")
+TRIPLE = "x86_64-unknown-linux-gnu"
+# Public data a model may define (tools/layout.py); identical in every variant.
+SHARED_SYMBOLS = ("alexnet_input_layout",)
+
+DISPATCH_TEMPLATE = r"""/* Generated by tools/isa.py: load-time ISA dispatch of alexnet.  Do not
+ * edit. */
+%(externs)s
+
+static const char *const variant_names[] = {%(names)s};
+
+/* Index of the best variant this CPU runs, highest level first. */
+static int select_variant(void) {
+    __builtin_cpu_init();
+%(checks)s
+    return 0;
+}
+
+const char *alexnet_isa(void) {
+    return variant_names[select_variant()];
+}
+
+typedef void (*alexnet_fn)(void);
+
+/* Runs from the dynamic loader's IRELATIVE relocation, before main. */
+static alexnet_fn resolve_alexnet(void) {
+    static const alexnet_fn variants[] = {%(symbols)s};
+    return variants[select_variant()];
+}
+
+void alexnet(void) __attribute__((ifunc("resolve_alexnet")));
+"""
+
+
+def parse_variants(text):
+    """Variant names from a comma-separated list (or all), lowest level first."""
+    names = list(DEFAULT_VARIANTS) if text in (None, "", "all") else text.split(",")
+    unknown = [n for n in names if n not in ISAS]
+    if unknown:
+        raise ValueError("unknown ISA variant %s (expected %s)"
+                         % (", ".join(unknown), ", ".join(ISAS)))
+    return [n for n in ISAS if n in names]
+
+
+def symbol(isa):
+    return "%s_%s" % (ENTRY, isa.replace(".", ""))
+
+
+def variant_flags(flags, isa):
+    """llc flags for one variant: its CPU level instead of native, object output."""
+    flags = [f for f in flags if not f.startswith(("-mcpu=", "-mattr=", "-filetype="))]
+    return flags + ["-mcpu=" + ISAS[isa][0], "-filetype=obj"]
+
+
+def dispatcher(variants):
+    """Source of alexnet_isa.c for `variants` (lowest level first)."""
+    checks = []
+    for i, isa in reversed(list(enumerate(variants))):
+        features = ISAS[isa][1]
+        if i == 0 or not features:
+            continue
+        checks.append("    if (%s) {\n        return %d;\n    }" % (
+            " &&\n        ".join('__builtin_cpu_supports("%s")' % f for f in features), i))
+    return DISPATCH_TEMPLATE % {
+        "externs": "\n".join("extern void %s(void);" % symbol(isa) for isa in variants),
+        "names": ", ".join('"%s"' % isa for isa in variants),
+        "checks": "\n".join(checks),
+        "symbols": ", ".join(symbol(isa) for isa in variants),
+    }
+
+
+def build_variants(ll, opt_passes, llc_flags, variants, output, workdir, cc="clang"):
+    """Compile `ll` once per variant and link them with the dispatcher into `output`."""
+    objects = []
+    for isa in variants:
+        name = symbol(isa)
+        codegen_input = ll
+        if opt_passes:
+            codegen_input = "%s.bc" % name
+            subprocess.run(["opt", "-mtriple=" + TRIPLE, "-mcpu=" + ISAS[isa][0],
+                            "-passes=" + opt_passes, ll, "-o", codegen_input],
+                           cwd=workdir, check=True)
+        raw = "%s_raw.o" % name
+        subprocess.run(["llc"] + variant_flags(llc_flags, isa) + [codegen_input, "-o", raw],
+                       cwd=workdir, check=True)
+        rename = ["objcopy", "--redefine-sym", "%s=%s" % (ENTRY, name)]
+        rename += ["--weaken-symbol=%s" % s for s in SHARED_SYMBOLS]
+        subprocess.run(rename + [raw, name + ".o"], cwd=workdir, check=True)
+        objects.append(name + ".o")
+        print("  %s: -mcpu=%s -> %s.o" % (isa, ISAS[isa][0], name))
+
+    with open(os.path.join(workdir, "alexnet_isa.c"), "w") as f:
+        f.write(dispatcher(variants))
+    subprocess.run([cc, "-O2", "-c", "alexnet_isa.c", "-o", "alexnet_isa.o"],
+                   cwd=workdir, check=True)
+    subprocess.run(["ld", "-r", "-o", output, "alexnet_isa.o"] + objects,
+                   cwd=workdir, check=True)
+    print("Wrote %s (%s)" % (output, ", ".join(variants)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("build", help="compile LLVM IR into a multi-ISA object")
+    p.add_argument("-i", "--input", required=True, help="LLVM IR of Stage 12")
+    p.add_argument("--opt-passes", help="Stage 13 pipeline (omit to skip opt)")
+    p.add_argument("--llc-flags", default="-O3 -march=x86-64",
+                   help="Stage 14 llc flags; -mcpu/-mattr are replaced per variant")
+    p.add_argument("--variants", default="all",
+                   help="comma-separated from %s (default %s)"
+                        % (", ".join(ISAS), ",".join(DEFAULT_VARIANTS)))
+    p.add_argument("--cc", default="clang")
+    p.add_argument("-o", "--output", default="alexnet.o")
+    args = parser.parse_args()
+    try:
+        variants = parse_variants(args.variants)
+    except ValueError as err:
+        parser.error(str(err))
+    workdir = os.path.dirname(os.path.abspath(args.output))
+    build_variants(os.path.abspath(args.input), args.opt_passes, shlex.split(args.llc_flags),
+                   variants, os.path.abspath(args.output), workdir, args.cc)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
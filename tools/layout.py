@@ -0,0 +1,292 @@
+"""Channels-last (NHWC) activations for the whole network.
+
+model.py exports NCHW, so the inner loops of every convolution and pool
+stride over a plane of H*W floats from one channel to the next, and
+vectorizing over channels needs gathers.  --propagate-layout rewrites the
+conv part of the network to NHWC, right after Stage 1:
+
+- linalg.conv_2d_nchw_fchw becomes linalg.conv_2d_nhwc_fhwc; constant
+  filters are transposed to FHWC here, so the output channels of one tap
+  are contiguous;
+- linalg.pooling_nchw_max/sum become their NHWC forms, 4-D tensor.pad and
+  linalg.fill are rewritten on NHWC tensors;
+- elementwise linalg.generic ops on 4-D tensors (the bias broadcast and
+  ReLU) iterate in (n, h, w, c) order over NHWC operands.
+
+Each rewritten op first gets transposes on its 4-D operands and result.  A
+transpose back to NCHW that feeds a transpose to NHWC is skipped, so
+transposes only remain where an op that was not rewritten reads a 4-D
+value: the flatten in front of fc6, 9216 floats.  The model's input is
+switched to NHWC as well, so the driver writes the image as HWC.  The model
+records this by defining `alexnet_input_layout` ("NHWC"), which main.c
+checks.  With keep-input, the input stays NCHW and is transposed inside
+the model.
+
+The step runs after the conv rewrites of the same stage and before
+--fuse-conv.  Blocked layouts such as NCHW8c are not produced here: the
+named linalg convolutions have no blocked form.  --pack-weights is the
+blocked layout for the filters.
+
+Usage:
+  python3 tools/phase_driver.py -p o1 --layout nhwc
+  python3 tools/phase_driver.py -p o1 --layout nhwc --pack-weights fc6,fc7,fc8
+"""
+
+from conv_rewrite import CANONICALIZE, NAMED_CONV, REWRITES, copy_layer, with_conv_step
+from tiling import apply_transform, walk_ops
+from weights import Weights, resource_constant
+
+LAYOUT_PASS = "propagate-layout"
+TAG = "propagate_layout"
+LAYOUTS = ("nhwc",)
+INPUT_LAYOUT_SYMBOL = "alexnet_input_layout"
+TO_NHWC = [0, 2, 3, 1]
+TO_NCHW = [0, 3, 1, 2]
+POOLS = {"linalg.pooling_nchw_max": "pooling_nhwc_max",
+         "linalg.pooling_nchw_sum": "pooling_nhwc_sum"}
+
+
+def _rank4(value):
+    from mlir.ir import RankedTensorType
+
+    return RankedTensorType.isinstance(value.type) and RankedTensorType(value.type).rank == 4
+
+
+def _permutation(op):
+    from mlir.ir import DenseI64ArrayAttr
+
+    if op is None or not hasattr(op, "name") or op.name != "linalg.transpose":
+        return None
+    return list(DenseI64ArrayAttr(op.attributes["permutation"]))
+
+
+class Rewriter:
+    """Moves 4-D values to NHWC one op at a time, in program order."""
+
+    def __init__(self, weights):
+        self.weights = weights
+        self.rewritten = 0
+
+    def transpose(self, value, perm):
+        from mlir.dialects import linalg, tensor
+        from mlir.dialects._ods_common import _get_op_result_or_value as result
+        from mlir.ir import RankedTensorType
+
+        ty = RankedTensorType(value.type)
+        empty = tensor.EmptyOp([ty.shape[p] for p in perm], ty.element_type)
+        return result(linalg.transpose(value, outs=[empty], permutation=perm))
+
+    def nhwc(self, value):
+        """`value` in NHWC, at the current insertion point."""
+        from mlir.dialects import tensor
+        from mlir.ir import RankedTensorType
+
+        owner = value.owner
+        owner = owner.operation if hasattr(owner, "operation") else None
+        if _permutation(owner) == TO_NCHW:
+            return owner.operands[0]
+        if owner is not None and owner.name == "tensor.empty":
+            ty = RankedTensorType(value.type)
+            return tensor.EmptyOp([ty.shape[p] for p in TO_NHWC], ty.element_type).result
+        return self.transpose(value, TO_NHWC)
+
+    def _replace(self, op, nhwc_result):
+        op.results[0].replace_all_uses_with(self.transpose(nhwc_result, TO_NCHW))
+        copy_layer(op, nhwc_result.owner)
+        op.erase()
+        self.rewritten += 1
+
+    def conv(self, op):
+        from mlir.dialects import linalg
+        from mlir.dialects._ods_common import _get_op_result_or_value as result
+        from mlir.ir import DenseIntElementsAttr, RankedTensorType
+
+        inp, filt, init = op.operands
+        strides = [int(v) for v in DenseIntElementsAttr(op.attributes["strides"])]
+        dilations = [int(v) for v in DenseIntElementsAttr(op.attributes["dilations"])]
+        weights = self.weights.source(filt)
+        if weights is not None:
+            weights = weights.transpose(0, 2, 3, 1)
+            ty = RankedTensorType(filt.type)
+            fhwc = resource_constant(
+                weights, "nhwc_filter_%d" % self.rewritten,
+                RankedTensorType.get(list(weights.shape), ty.element_type)).result
+        else:
+            fhwc = self.transpose(filt, TO_NHWC)
+        return result(linalg.conv_2d_nhwc_fhwc(self.nhwc(inp), fhwc, outs=[self.nhwc(init)],
+                                               strides=strides, dilations=dilations))
+
+    def pool(self, op):
+        from mlir.dialects import linalg
+        from mlir.dialects._ods_common import _get_op_result_or_value as result
+        from mlir.ir import DenseIntElementsAttr
+
+        inp, window, init = op.operands
+        build = getattr(linalg, POOLS[op.name])
+        return result(build(self.nhwc(inp), window, outs=[self.nhwc(init)],
+                            strides=[int(v) for v in
+                                     DenseIntElementsAttr(op.attributes["strides"])],
+                            dilations=[int(v) for v in
+                                       DenseIntElementsAttr(op.attributes["dilations"])]))
+
+    def fill(self, op):
+        from mlir.dialects import linalg
+        from mlir.dialects._ods_common import _get_op_result_or_value as result
+
+        return result(linalg.fill(op.operands[0], outs=[self.nhwc(op.operands[1])]))
+
+    def pad(self, op):
+        from mlir.dialects import tensor
+        from mlir.ir import (DenseI64ArrayAttr, IndexType, InsertionPoint, RankedTensorType)
+
+        if len(op.operands) != 1:
+            return None  # dynamic padding
+        value = list(op.regions[0].blocks[0])[-1].operands[0]
+        owner = value.owner
+        if not hasattr(owner, "operation") or owner.operation.parent == op:
+            return None  # the padding value is computed inside the pad
+        low = [list(DenseI64ArrayAttr(op.attributes["static_low"]))[p] for p in TO_NHWC]
+        high = [list(DenseI64ArrayAttr(op.attributes["static_high"]))[p] for p in TO_NHWC]
+        ty = RankedTensorType(op.results[0].type)
+        new = tensor.PadOp(RankedTensorType.get([ty.shape[p] for p in TO_NHWC], ty.element_type),
+                           self.nhwc(op.operands[0]), [], [], DenseI64ArrayAttr.get(low),
+                           DenseI64ArrayAttr.get(high))
+        block = new.regions[0].blocks.append(*[IndexType.get()] * 4)
+        with InsertionPoint(block):
+            tensor.YieldOp(value)
+        return new.result
+
+    def generic(self, op):
+        """An elementwise generic with a 4-D result, iterating in (n, h, w, c) order."""
+        from mlir.dialects import linalg
+        from mlir.ir import (AffineDimExpr, AffineMap, AffineMapAttr, ArrayAttr,
+                             InsertionPoint, RankedTensorType)
+
+        maps = [AffineMapAttr(m).value for m in op.attributes["indexing_maps"]]
+        iterators = ArrayAttr(op.attributes["iterator_types"])
+        if (len(op.results) != 1 or len(iterators) != 4
+                or any("parallel" not in str(it) for it in iterators)
+                or maps[-1] != AffineMap.get_identity(4)):
+            return None
+        d = [AffineDimExpr.get(i) for i in range(4)]
+        # Old loop (n, c, h, w) in terms of the new (n, h, w, c) loops.
+        old_dims = AffineMap.get(4, 0, [d[0], d[3], d[1], d[2]])
+        operands, new_maps = [], []
+        for value, m in zip(op.operands, maps):
+            exprs = [e.compose(old_dims) for e in m.results]
+            if _rank4(value):
+                value = self.nhwc(value)
+                exprs = [exprs[p] for p in TO_NHWC]
+            operands.append(value)
+            new_maps.append(AffineMapAttr.get(AffineMap.get(4, 0, exprs)))
+        ty = RankedTensorType(op.results[0].type)
+        new = linalg.GenericOp(
+            [RankedTensorType.get([ty.shape[p] for p in TO_NHWC], ty.element_type)],
+            operands[:-1], operands[-1:], ArrayAttr.get(new_maps), iterators)
+        old_block = op.regions[0].blocks[0]
+        block = new.regions[0].blocks.append(*[arg.type for arg in old_block.arguments])
+        mapping = dict(zip(old_block.arguments, block.arguments))
+        for body_op in old_block:
+            clone = body_op.operation.clone(ip=InsertionPoint(block))
+            for i, operand in enumerate(clone.operands):
+                if operand in mapping:
+                    clone.operands[i] = mapping[operand]
+            mapping.update(zip(body_op.operation.results, clone.results))
+        return new.results[0]
+
+    def rewrite(self, op):
+        from mlir.ir import InsertionPoint
+
+        if not op.results or not _rank4(op.results[0]):
+            return
+        if op.name == NAMED_CONV:
+            build = self.conv
+        elif op.name in POOLS:
+            build = self.pool
+        elif op.name == "linalg.fill":
+            build = self.fill
+        elif op.name == "tensor.pad":
+            build = self.pad
+        elif op.name == "linalg.generic":
+            build = self.generic
+        else:
+            return
+        with InsertionPoint(op), op.location:
+            new = build(op)
+        if new is not None:
+            self._replace(op, new)
+
+    def input(self, func):
+        """Take the function's 4-D argument in NHWC; returns whether it changed."""
+        from mlir.ir import (FunctionType, InsertionPoint, RankedTensorType, TypeAttr)
+
+        block = func.regions[0].blocks[0]
+        args = [arg for arg in block.arguments if _rank4(arg)]
+        if len(args) != 1:
+            return False
+        arg = args[0]
+        ty = RankedTensorType(arg.type)
+        uses = [(use.owner, use.operand_number) for use in arg.uses]
+        arg.set_type(RankedTensorType.get([ty.shape[p] for p in TO_NHWC], ty.element_type))
+        with InsertionPoint.at_block_begin(block), func.location:
+            nchw = self.transpose(arg, TO_NCHW)
+        for owner, index in uses:
+            owner.operands[index] = nchw
+        func_type = FunctionType(TypeAttr(func.attributes["function_type"]).value)
+        func.attributes["function_type"] = TypeAttr.get(FunctionType.get(
+            [a.type for a in block.arguments], func_type.results))
+        return True
+
+
+def _declare_input_layout(module, layout):
+    """memref.global constant @alexnet_input_layout = "NHWC", read by main.c."""
+    import numpy as np
+    from mlir.dialects import memref
+    from mlir.ir import (DenseElementsAttr, InsertionPoint, IntegerType, MemRefType,
+                         TypeAttr)
+
+    data = np.frombuffer(layout.upper().encode(), dtype=np.int8)
+    ty = MemRefType.get([len(data)], IntegerType.get_signless(8))
+    with InsertionPoint.at_block_begin(module.body), module.operation.location:
+        memref.GlobalOp(sym_name=INPUT_LAYOUT_SYMBOL, type_=TypeAttr.get(ty), constant=True,
+                        initial_value=DenseElementsAttr.get(
+                            data, type=IntegerType.get_signless(8)))
+
+
+def layout_pass(module, options):
+    """Driver implementation of --propagate-layout."""
+    from mlir.ir import RankedTensorType
+
+    flags = [key for key, value in options if value is None]
+    layout = dict(options).get("layout") or next((f for f in flags if f in LAYOUTS), "nhwc")
+    if layout not in LAYOUTS:
+        raise ValueError("layout=%s: expected one of %s" % (layout, ", ".join(LAYOUTS)))
+    rewriter = Rewriter(Weights(module))
+    funcs = [op for op in walk_ops(module.operation)
+             if op.name == "func.func" and op.regions[0].blocks]
+    for func in funcs:
+        block = func.regions[0].blocks[0]
+        if any(_rank4(arg) and not RankedTensorType(arg.type).has_static_shape
+               for arg in block.arguments):
+            raise ValueError("%s needs a static batch (model.py --batch N)" % LAYOUT_PASS)
+    changed_input = False
+    for func in funcs:
+        if "keep-input" not in flags:
+            changed_input |= rewriter.input(func)
+        for op in list(func.regions[0].blocks[0]):
+            rewriter.rewrite(op.operation)
+    if changed_input:
+        _declare_input_layout(module, layout)
+    # Drop the transposes back to NCHW that nothing reads any more.
+    apply_transform(module, CANONICALIZE, {}, TAG)
+    print("%s: %d ops in %s%s" % (LAYOUT_PASS, rewriter.rewritten, layout.upper(),
+                                  ", input in " + layout.upper() if changed_input else ""))
+
+
+def layout_flag(layout, keep_input=False):
+    return '--%s="layout=%s%s"' % (LAYOUT_PASS, layout, " keep-input" if keep_input else "")
+
+
+def with_layout_step(stages, flag):
+    """with_conv_step(): the layout step runs right after the conv rewrites."""
+    return with_conv_step(stages, flag)
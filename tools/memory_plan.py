@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+"""Static memory planning of the intermediate activations.
+
+After bufferization every intermediate activation is a memref.alloc, and
+--finalize-memref-to-llvm turns each one into a call to the allocator (and,
+in O1/O2, a free) on every inference.  All AlexNet shapes are static, so the buffers can
+be laid out once instead:
+
+- each alloc lives from its position in the function to the last use of the
+  buffer or of a view of it;
+- buffers are placed in one arena, largest first, at the lowest 64-byte
+  aligned offset that does not overlap a buffer alive at the same time;
+- each alloc becomes a memref.view of the arena, and its deallocs go away.
+
+--plan-memory runs at the end of the bufferization stage, before Stage 4b
+inserts deallocations.  With arena=global the arena is an uninitialized
+private memref.global, i.e. allocated once, in .bss.  With arena=external it
+is an external @alexnet_arena that the caller defines: main.c does so when
+built with -DALEXNET_ARENA_BYTES=<arena bytes>.  Buffers returned by the
+function (only in the baseline pipeline; O1 and O2 write into the caller's
+buffer) are left on the heap, and so are allocs nested in loops (e.g. after
+O2's Stage 1b tiling) or with dynamic shapes; both are reported as heap
+buffers.  `report` prints the footprint per pipeline without rewriting
+anything.
+
+Either way the arena is one buffer per process, so a planned alexnet() is
+not reentrant: only one thread may run it at a time.
+
+Usage:
+  python3 tools/phase_driver.py -p o1 --plan-memory
+  python3 tools/memory_plan.py report -p baseline -p o1 -p o2
+"""
+
+import argparse
+import json
+import sys
+
+from pipelines import PIPELINES, parse_pass_flag
+from tiling import walk_ops
+
+MEMORY_PASS = "plan-memory"
+ARENA_SYMBOL = "alexnet_arena"
+ALIGNMENT = 64
+VIEW_OPS = ("memref.subview", "memref.expand_shape", "memref.collapse_shape",
+            "memref.cast", "memref.reinterpret_cast", "memref.view")
+FREE_OPS = ("memref.dealloc",)
+
+
+def _align(n):
+    return -(-n // ALIGNMENT) * ALIGNMENT
+
+
+def _top_level(op, func):
+    """Ancestor of `op` in the body of `func`."""
+    op = op.operation
+    while op.parent is not None and op.parent.operation != func.operation:
+        op = op.parent.operation
+    return op
+
+
+def _aliases(value):
+    """`value` and every view derived from it."""
+    out, work = [], [value]
+    while work:
+        v = work.pop()
+        out.append(v)
+        for use in v.uses:
+            user = use.owner
+            if user.name in VIEW_OPS and user.operands[0] == v:
+                work.extend(user.results)
+    return out
+
+
+def buffers(func):
+    """[{op, bytes, start, end, frees, escapes}] of the static allocs of a function."""
+    from mlir.ir import MemRefType
+
+    body = list(func.regions[0].blocks[0])
+    index = {op.operation: n for n, op in enumerate(body)}
+    out = []
+    for n, op in enumerate(body):
+        op = op.operation
+        if op.name != "memref.alloc":
+            continue
+        ty = MemRefType(op.results[0].type)
+        if not ty.has_static_shape:
+            continue
+        end, frees, escapes = n, [], False
+        for value in _aliases(op.results[0]):
+            for use in value.uses:
+                user = use.owner
+                if user.name in FREE_OPS:
+                    frees.append(user)
+                    continue
+                escapes |= user.name == "func.return"
+                end = max(end, index[_top_level(user, func)])
+        out.append({"op": op, "shape": list(ty.shape),
+                    "bytes": _align(ty.get_number_of_elements() * ty.element_type.width // 8),
+                    "start": n, "end": end, "frees": frees, "escapes": escapes})
+    return out
+
+
+def unplanned(func):
+    """[{op, bytes}] of the allocs buffers() skips: nested or dynamically shaped.
+
+    Their bytes are per execution, and 0 when the shape is dynamic.
+    """
+    from mlir.ir import MemRefType
+
+    top = {op.operation for op in func.regions[0].blocks[0]}
+    out = []
+    for op in walk_ops(func):
+        if op.name != "memref.alloc":
+            continue
+        ty = MemRefType(op.results[0].type)
+        if op in top and ty.has_static_shape:
+            continue
+        size = 0
+        if ty.has_static_shape:
+            size = _align(ty.get_number_of_elements() * ty.element_type.width // 8)
+        out.append({"op": op, "shape": list(ty.shape), "bytes": size})
+    return out
+
+
+def assign_offsets(bufs):
+    """Greedy by size: place each buffer at the lowest offset free for its lifetime.
+
+    Returns the arena size; sets "offset" on every buffer.
+    """
+    placed = []
+    for b in sorted(bufs, key=lambda b: (-b["bytes"], b["start"])):
+        live = sorted((p for p in placed if p["start"] <= b["end"] and b["start"] <= p["end"]),
+                      key=lambda p: p["offset"])
+        offset = 0
+        for p in live:
+            if offset + b["bytes"] <= p["offset"]:
+                break
+            offset = max(offset, p["offset"] + p["bytes"])
+        b["offset"] = offset
+        placed.append(b)
+    return max((b["offset"] + b["bytes"] for b in bufs), default=0)
+
+
+def peak_live(bufs):
+    """Largest sum of the buffers alive at one point: a lower bound for the arena."""
+    points = {b["start"] for b in bufs}
+    return max((sum(b["bytes"] for b in bufs if b["start"] <= t <= b["end"]) for t in points),
+               default=0)
+
+
+def plan(module):
+    """{function name: (planned buffers, arena bytes, heap buffers)}."""
+    out = {}
+    for op in walk_ops(module.operation):
+        if op.name != "func.func" or not op.regions[0].blocks:
+            continue
+        bufs = buffers(op)
+        planned = [b for b in bufs if not b["escapes"]]
+        heap = [b for b in bufs if b["escapes"]] + unplanned(op)
+        out[op.attributes["sym_name"].value] = (planned, assign_offsets(planned), heap)
+    return out
+
+
+def summary(module):
+    rows = []
+    for name, (planned, arena, heap) in plan(module).items():
+        rows.append({"function": name, "buffers": len(planned),
+                     "total_bytes": sum(b["bytes"] for b in planned),
+                     "peak_live_bytes": peak_live(planned), "arena_bytes": arena,
+                     "heap_buffers": len(heap),
+                     "heap_bytes": sum(b["bytes"] for b in heap)})
+    return rows
+
+
+def memory_pass(module, options):
+    """Driver implementation of --plan-memory."""
+    from mlir.dialects import arith, memref
+    from mlir.ir import (IndexType, InsertionPoint, IntegerAttr, IntegerType, MemRefType,
+                         TypeAttr, UnitAttr)
+
+    mode = dict(options).get("arena") or "global"
+    if mode not in ("global", "external"):
+        raise ValueError("arena=%s: expected global or external" % mode)
+    plans = plan(module)
+    if len(plans) > 1:
+        raise ValueError("memory planning expects one function, found %s" % ", ".join(plans))
+    for planned, arena, heap in plans.values():
+        if not planned:
+            return
+        arena_type = MemRefType.get([arena], IntegerType.get_signless(8))
+        with InsertionPoint.at_block_begin(module.body), module.operation.location:
+            if mode == "global":
+                memref.GlobalOp(sym_name=ARENA_SYMBOL, type_=TypeAttr.get(arena_type),
+                                sym_visibility="private", initial_value=UnitAttr.get(),
+                                alignment=IntegerAttr.get(IntegerType.get_signless(64),
+                                                          ALIGNMENT))
+            else:
+                memref.GlobalOp(sym_name=ARENA_SYMBOL, type_=TypeAttr.get(arena_type))
+        for b in planned:
+            alloc = b["op"]
+            with InsertionPoint(alloc), alloc.location:
+                base = memref.GetGlobalOp(arena_type, ARENA_SYMBOL)
+                shift = arith.ConstantOp(IndexType.get(), b["offset"])
+                view = memref.ViewOp(alloc.results[0].type, base.result, shift.result, [])
+            for free in b["frees"]:
+                free.erase()
+            alloc.results[0].replace_all_uses_with(view.result)
+            alloc.erase()
+        print("%s: %d buffers in a %.1f MB arena (%s), %d left on the heap" % (
+            MEMORY_PASS, len(planned), arena / 2.0 ** 20, mode, len(heap)))
+
+
+def memory_stage_index(stages):
+    """Index of the stage that bufferizes; the plan runs at its end."""
+    for n, stage in enumerate(stages):
+        if any(parse_pass_flag(p)[0] == "one-shot-bufferize" for p in stage.passes):
+            return n
+    raise ValueError("pipeline has no bufferization stage")
+
+
+def with_memory_plan(stages, arena="global"):
+    n = memory_stage_index(stages)
+    flag = '--%s="arena=%s"' % (MEMORY_PASS, arena)
+    out = list(stages)
+    passes = [p for p in out[n].passes if parse_pass_flag(p)[0] != MEMORY_PASS]
+    out[n] = out[n]._replace(passes=passes + [flag])
+    return out
+
+
+# -- Command line -------------------------------------------------------------------
+
+def main():
+    from mlir.ir import Context
+    from phase_driver import load_module, run_passes
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("report", help="activation footprint of each pipeline")
+    p.add_argument("-p", "--pipeline", action="append", choices=sorted(PIPELINES))
+    p.add_argument("-i", "--input", default="alexnet_linalg.mlir")
+    p.add_argument("-o", "--output", default="memory_plan.json")
+    args = parser.parse_args()
+
+    mb = 2.0 ** 20
+    rows = []
+    print("%-14s %8s %10s %10s %10s %6s" % ("pipeline", "buffers", "total", "peak",
+                                           "arena", "heap"))
+    for pipeline in args.pipeline or ["baseline", "o1", "o2"]:
+        stages = PIPELINES[pipeline]
+        with Context():
+            module = load_module(args.input)
+            for stage in stages[:memory_stage_index(stages) + 1]:
+                run_passes(module, stage.passes)
+            for row in summary(module):
+                row["pipeline"] = pipeline
+                rows.append(row)
+                print("%-14s %8d %7.1f MB %7.1f MB %7.1f MB %6d" % (
+                    pipeline, row["buffers"], row["total_bytes"] / mb,
+                    row["peak_live_bytes"] / mb, row["arena_bytes"] / mb, row["heap_buffers"]))
+    with open(args.output, "w") as f:
+        json.dump(rows, f, indent=1)
+    print("Wrote %s" % args.output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
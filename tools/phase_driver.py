@@ -0,0 +1,421 @@
+#!/usr/bin/env python3
+"""Run a pipeline script's stage list in a single process.
+
+The shell pipelines launch mlir-opt once per stage, so the whole AlexNet
+module (weights included) is printed and re-parsed as text between every
+stage.  This driver parses alexnet_linalg.mlir once through the MLIR Python
+bindings, runs every stage of the chosen pipeline on the in-memory module and
+only prints the stages that were asked for.  The final LLVM-dialect module is
+then handed to mlir-translate/opt/llc exactly like stages 12-14 of the script.
+
+Usage:
+  python3 tools/phase_driver.py -p o1 -i alexnet_linalg.mlir
+  python3 tools/phase_driver.py -p o2 --dump-stage 5 --dump-stage 11
+  python3 tools/phase_driver.py -p baseline --dump-intermediates --mlir-only
+  python3 tools/phase_driver.py -p o1 --emit-bytecode --dump-intermediates --text-stage 6
+  python3 tools/phase_driver.py -p o1 --cache-dir ~/.cache/phase_ordering
+  python3 tools/phase_driver.py -p o1 --fingerprints ~/.cache/phase_ordering/fingerprints
+  python3 tools/phase_driver.py -p o1 --tile-config tiles.json
+  python3 tools/phase_driver.py -p o1 --im2col all
+  python3 tools/phase_driver.py -p o1 --winograd conv3,conv4,conv5
+  python3 tools/phase_driver.py -p o1 --pack-weights
+  python3 tools/phase_driver.py -p o1 --layout nhwc
+  python3 tools/phase_driver.py -p o1 -i alexnet_linalg_dyn.mlir --dynamic-batch
+  python3 tools/phase_driver.py -p o1 --isa-variants sse4.2,avx2,avx512
+  python3 tools/phase_driver.py -p o1 --fuse-conv
+  python3 tools/phase_driver.py -p o1 --plan-memory
+  python3 tools/phase_driver.py -p o1-affine --pass-report --mlir-only
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+from pipelines import (BACKENDS, PIPELINES, parse_pass_flag, pass_pipeline, read_spec,
+                       stage_label)
+from fingerprint import (FingerprintIndex, backend_key, combine, llvm_ir_fingerprint,
+                         module_fingerprint)
+from stage_cache import StageCache, hash_file, normalize_pass
+import batching
+import conv_rewrite
+import fusion
+import isa
+import layout
+import memory_plan
+import tiling
+import weight_packing
+
+# Steps that appear in stage lists like passes but are run by this driver
+# through the Python bindings: name -> function(module, options).
+DRIVER_PASSES = {
+    tiling.TILE_PASS: tiling.tile_pass,
+    conv_rewrite.IM2COL_PASS: conv_rewrite.im2col_pass,
+    conv_rewrite.WINOGRAD_PASS: conv_rewrite.winograd_pass,
+    weight_packing.PACK_PASS: weight_packing.pack_pass,
+    layout.LAYOUT_PASS: layout.layout_pass,
+    fusion.FUSE_PASS: fusion.fuse_pass,
+    memory_plan.MEMORY_PASS: memory_plan.memory_pass,
+}
+
+
+def load_module(path):
+    from mlir.ir import Module
+
+    with open(path, "rb") as f:
+        data = f.read()
+    return Module.parse(data if data[:4] == b"ML\xefR" else data.decode())
+
+
+def write_module(module, path):
+    if path.endswith(".mlirbc"):
+        with open(path, "wb") as f:
+            module.operation.write_bytecode(f)
+    else:
+        with open(path, "w") as f:
+            module.operation.print(file=f)
+
+
+def stage_file(stage, bytecode):
+    """Output name of a stage; .mlir becomes .mlirbc in bytecode mode."""
+    if bytecode:
+        return os.path.splitext(stage.output)[0] + ".mlirbc"
+    return stage.output
+
+
+def run_passes(module, passes):
+    from mlir.passmanager import PassManager
+
+    segment = []
+    for flag in passes + [None]:
+        name, options = parse_pass_flag(flag) if flag else (None, None)
+        if flag and name not in DRIVER_PASSES:
+            segment.append(flag)
+            continue
+        if segment:
+            PassManager.parse(pass_pipeline(segment)).run(module.operation)
+            segment = []
+        if flag:
+            DRIVER_PASSES[name](module, options)
+
+
+LOOP_OPS = ("affine.for", "affine.parallel", "scf.for", "scf.parallel")
+
+
+def loop_counts(module):
+    counts = dict.fromkeys(LOOP_OPS, 0)
+    for op in tiling.walk_ops(module.operation):
+        if op.name in counts:
+            counts[op.name] += 1
+    return counts
+
+
+def run_reported(module, stage, passes, report, blob_digests=None):
+    """run_passes one pass at a time, recording whether each changed the IR."""
+    before, loops = module_fingerprint(module, blob_digests), loop_counts(module)
+    for flag in passes:
+        start = time.perf_counter()
+        run_passes(module, [flag])
+        elapsed = time.perf_counter() - start
+        after, loops_after = module_fingerprint(module, blob_digests), loop_counts(module)
+        report.append({"stage": stage_label(stage), "pass": flag,
+                       "seconds": round(elapsed, 3), "changed": after != before,
+                       "loops_before": loops, "loops_after": loops_after})
+        before, loops = after, loops_after
+
+
+def print_report(report):
+    print("\n%-5s %-44s %8s %8s  %s" % ("stage", "pass", "time", "IR", "loops"))
+    for entry in report:
+        moved = ["%s %d->%d" % (name, entry["loops_before"][name], entry["loops_after"][name])
+                 for name in LOOP_OPS
+                 if entry["loops_before"][name] != entry["loops_after"][name]]
+        print("%-5s %-44s %7.2fs %8s  %s" % (
+            entry["stage"], entry["pass"][:44], entry["seconds"],
+            "changed" if entry["changed"] else "no-op", ", ".join(moved)))
+    wasted = sum(e["seconds"] for e in report if not e["changed"])
+    print("%d of %d passes left the IR unchanged (%.2f s)"
+          % (sum(1 for e in report if not e["changed"]), len(report), wasted))
+
+
+def run_backend(backend, llvm_dialect_file, workdir, isa_variants=None):
+    print("Stage 12: Translate to LLVM IR...")
+    with open(os.path.join(workdir, backend.ll), "w") as ll:
+        subprocess.run(["mlir-translate", "--mlir-to-llvmir", llvm_dialect_file],
+                       stdout=ll, cwd=workdir, check=True)
+
+    if isa_variants:
+        # Stages 13-14 once per ISA level, with the flags of the final llc call.
+        print("Stages 13-14: one variant per ISA level...")
+        isa.build_variants(backend.ll, backend.opt_passes, backend.llc[-1][0], isa_variants,
+                           "alexnet.o", workdir)
+        return
+
+    codegen_input = backend.ll
+    if backend.opt_passes:
+        print("Stage 13: LLVM optimization passes...")
+        subprocess.run(["opt", "-passes=" + backend.opt_passes, backend.ll,
+                        "-o", backend.opt_output], cwd=workdir, check=True)
+        codegen_input = backend.opt_output
+
+    print("Stage 14: Generate native code...")
+    for flags, output in backend.llc:
+        subprocess.run(["llc"] + flags + [codegen_input, "-o", output],
+                       cwd=workdir, check=True)
+
+
+def dump_snapshot(snapshot, path):
+    if snapshot is None:
+        print("  no cached snapshot for this stage, %s not written" % path)
+    elif path.endswith(".mlirbc"):
+        shutil.copyfile(snapshot, path)
+    else:
+        write_module(load_module(snapshot), path)
+
+
+def stage_selected(stage, selection):
+    return stage_label(stage) in selection or stage.output in selection
+
+
+def should_dump(stage, args):
+    if args.dump_intermediates:
+        return True
+    return (stage_selected(stage, args.dump_stage)
+            or stage_selected(stage, args.text_stage))
+
+
+def claimed_twice(rewrites):
+    """Error for two conv rewrites ([(option, value)], in run order) naming one layer.
+
+    --im2col all claims every convolution.  --winograd all claims the
+    eligible ones, which are only known after Stage 1; --pack-weights then
+    fails on a layer it took.
+    """
+    earlier = []
+    for option, value in rewrites:
+        if not value:
+            continue
+        layers = set() if value == "all" else set(value.split(","))
+        for prev_option, prev in earlier:
+            both = sorted(l for l in layers
+                          if (l.startswith("conv") if prev is None else l in prev))
+            if both:
+                return "%s and %s both rewrite %s" % (prev_option, option, ", ".join(both))
+        # None: every convolution.
+        earlier.append((option, None if value == "all" and option == "--im2col" else layers))
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-p", "--pipeline", choices=sorted(PIPELINES), default="o1")
+    parser.add_argument("--spec",
+                        help="run a candidate pipeline saved by the search tools instead")
+    parser.add_argument("-i", "--input", default="alexnet_linalg.mlir")
+    parser.add_argument("-C", "--workdir", default=".",
+                        help="directory that receives dumps and build outputs")
+    parser.add_argument("--dump-intermediates", action="store_true",
+                        help="write every stage's output under its script name")
+    parser.add_argument("--dump-stage", action="append", default=[],
+                        metavar="N|FILE",
+                        help="write one stage's output (script stage number or file name)")
+    parser.add_argument("--emit-bytecode", action="store_true",
+                        help="write stage outputs as .mlirbc instead of text")
+    parser.add_argument("--text-stage", action="append", default=[],
+                        metavar="N|FILE",
+                        help="also write readable text for a stage in bytecode mode")
+    parser.add_argument("--cache-dir",
+                        help="stage cache; resume from the longest cached pass prefix")
+    parser.add_argument("--fingerprints", metavar="DIR",
+                        help="fingerprint the IR after each stage and stop early when an "
+                             "earlier candidate with a recorded result reached the same IR")
+    parser.add_argument("--tile-config", metavar="FILE",
+                        help="tile each conv/fc loop nest with the sizes in FILE "
+                             "(tools/tiling.py) instead of --affine-loop-tile")
+    parser.add_argument("--im2col", metavar="LAYERS",
+                        help="rewrite convolutions (comma-separated, or all) into "
+                             "im2col plus a packed GEMM after Stage 1")
+    parser.add_argument("--winograd", metavar="LAYERS",
+                        help="compute 3x3 stride-1 convolutions (comma-separated, or all) "
+                             "with Winograd F(4x4, 3x3) after Stage 1")
+    parser.add_argument("--pack-weights", metavar="LAYERS", nargs="?", const="all",
+                        help="pack the weights of the conv and fc layers (comma-separated, "
+                             "default all) into blocked layouts at compile time")
+    parser.add_argument("--layout", choices=layout.LAYOUTS,
+                        help="propagate this activation layout through the conv layers "
+                             "after Stage 1 (the driver writes the input in it)")
+    parser.add_argument("--keep-input-layout", action="store_true",
+                        help="with --layout, keep the NCHW input and transpose it in the model")
+    parser.add_argument("--fuse-conv", metavar="LAYERS", nargs="?", const="all",
+                        help="tile each convolution (comma-separated, default all) with its "
+                             "bias, ReLU and max-pool fused into the tile loop after Stage 1")
+    parser.add_argument("--fuse-channels", type=int, metavar="N",
+                        help="output channels per fused tile (default %d)"
+                             % fusion.DEFAULT_CHANNELS)
+    parser.add_argument("--fuse-rows", type=int, metavar="N",
+                        help="also tile the fused layers over N output rows")
+    parser.add_argument("--plan-memory", metavar="ARENA", nargs="?", const="global",
+                        choices=["global", "external"],
+                        help="place the intermediate buffers in one statically planned "
+                             "arena after bufferization (default global; external leaves "
+                             "@alexnet_arena to the caller)")
+    parser.add_argument("--dynamic-batch", action="store_true",
+                        help="input exported with model.py --dynamic-batch: pass memrefs "
+                             "as descriptors instead of bare pointers")
+    parser.add_argument("--isa-variants", metavar="ISAS", nargs="?", const="all",
+                        help="compile alexnet.o once per ISA level (comma-separated from "
+                             "%s; default %s) behind a load-time CPU dispatcher"
+                             % (", ".join(isa.ISAS), ",".join(isa.DEFAULT_VARIANTS)))
+    parser.add_argument("--pass-report", action="store_true",
+                        help="run passes one at a time and report which ones changed "
+                             "the IR and the loop ops (written to pass_report.json)")
+    parser.add_argument("--mlir-only", action="store_true",
+                        help="stop after the LLVM-dialect stage")
+    args = parser.parse_args()
+    isa_variants = None
+    if args.isa_variants:
+        try:
+            isa_variants = isa.parse_variants(args.isa_variants)
+        except ValueError as err:
+            parser.error(str(err))
+        if args.fingerprints:
+            parser.error("--fingerprints records single-ISA results; drop it with --isa-variants")
+
+    overlap = claimed_twice([("--im2col", args.im2col), ("--winograd", args.winograd),
+                             ("--pack-weights", args.pack_weights)])
+    if overlap:
+        parser.error(overlap)
+
+    from mlir.ir import Context
+
+    if args.spec:
+        stages, backend = read_spec(args.spec)
+    else:
+        stages, backend = PIPELINES[args.pipeline], BACKENDS[args.pipeline]
+    if args.dynamic_batch:
+        stages = batching.descriptor_abi(stages)
+    if args.tile_config:
+        with open(args.tile_config) as f:
+            stages = tiling.with_tile_config(stages, json.load(f))
+    if args.im2col:
+        layers = [] if args.im2col == "all" else args.im2col.split(",")
+        stages = conv_rewrite.with_conv_step(
+            stages, conv_rewrite.conv_flag(conv_rewrite.IM2COL_PASS, layers))
+    if args.winograd:
+        layers = [] if args.winograd == "all" else args.winograd.split(",")
+        stages = conv_rewrite.with_conv_step(
+            stages, conv_rewrite.conv_flag(conv_rewrite.WINOGRAD_PASS, layers))
+    if args.pack_weights:
+        layers = [] if args.pack_weights == "all" else args.pack_weights.split(",")
+        stages = conv_rewrite.with_conv_step(
+            stages, conv_rewrite.conv_flag(weight_packing.PACK_PASS, layers))
+    if args.layout:
+        stages = layout.with_layout_step(
+            stages, layout.layout_flag(args.layout, args.keep_input_layout))
+    if args.fuse_conv:
+        layers = [] if args.fuse_conv == "all" else args.fuse_conv.split(",")
+        stages = fusion.with_fusion_step(
+            stages, fusion.fusion_flag(layers, args.fuse_channels, args.fuse_rows))
+    if args.plan_memory:
+        stages = memory_plan.with_memory_plan(stages, args.plan_memory)
+    os.makedirs(args.workdir, exist_ok=True)
+
+    all_passes = [p for stage in stages for p in stage.passes]
+    cache = StageCache(args.cache_dir) if args.cache_dir else None
+    cached, source = 0, args.input
+    if cache:
+        input_key = hash_file(args.input)
+        cached, snapshot = cache.lookup(input_key, all_passes)
+        if snapshot:
+            source = snapshot
+            print("Stage cache: resuming after %d of %d passes" % (cached, len(all_passes)))
+
+    fp_index = FingerprintIndex(args.fingerprints) if args.fingerprints else None
+    fingerprints, stage_keys = {}, []
+    report = []
+
+    with Context():
+        start = time.perf_counter()
+        module = load_module(source)
+        print("Loaded %s in %.2f s" % (source, time.perf_counter() - start))
+        # Weights are hashed once per handle for all the stages of this module.
+        blob_digests = {}
+        # A snapshot is already the output of a stage; only compare against
+        # the real input.
+        previous = module_fingerprint(module, blob_digests) if fp_index and not cached else None
+
+        done = 0
+        for index, stage in enumerate(stages, 1):
+            print(stage.title)
+            todo = stage.passes[max(cached - done, 0):]
+            done += len(stage.passes)
+            start = time.perf_counter()
+            if todo:
+                if args.pass_report:
+                    run_reported(module, stage, todo, report, blob_digests)
+                else:
+                    run_passes(module, todo)
+                if cache:
+                    cache.store(input_key, all_passes[:done], module)
+            elapsed = time.perf_counter() - start
+
+            outputs = []
+            # The last stage feeds mlir-translate, so it is always written.
+            if index == len(stages) or should_dump(stage, args):
+                outputs.append(stage_file(stage, args.emit_bytecode))
+            if args.emit_bytecode and stage_selected(stage, args.text_stage):
+                outputs.append(stage.output)
+            for output in outputs:
+                path = os.path.join(args.workdir, output)
+                if done >= cached:
+                    write_module(module, path)
+                else:
+                    # Stage lies inside the cached prefix; dump its snapshot.
+                    dump_snapshot(cache.snapshot(input_key, all_passes[:done]), path)
+
+            if todo:
+                print("  %.2f s" % elapsed)
+            else:
+                print("  cached")
+
+            if fp_index and done >= cached:
+                fp = module_fingerprint(module, blob_digests)
+                fingerprints[stage_label(stage)] = fp
+                print("  fingerprint %s%s" % (fp[:12], " (unchanged)" if fp == previous else ""))
+                previous = fp
+                rest = [normalize_pass(p) for later in stages[index:] for p in later.passes]
+                stage_key = combine(fp, json.dumps(rest), backend_key(backend))
+                final = fp_index.final_for(stage_key)
+                if final and fp_index.result(final) is not None and not args.mlir_only:
+                    # Same IR and same remaining pipeline as an earlier candidate.
+                    with open(os.path.join(args.workdir, "dedup.json"), "w") as f:
+                        json.dump({"stage": stage_label(stage), "final": final}, f)
+                    print("IR matches an earlier candidate after stage %s; "
+                          "reusing its result" % stage_label(stage))
+                    return 0
+                stage_keys.append(stage_key)
+
+    if args.pass_report:
+        print_report(report)
+        with open(os.path.join(args.workdir, "pass_report.json"), "w") as f:
+            json.dump(report, f, indent=1)
+
+    if not args.mlir_only:
+        run_backend(backend, stage_file(stages[-1], args.emit_bytecode),
+                    args.workdir, isa_variants)
+        if fp_index:
+            final = combine(llvm_ir_fingerprint(os.path.join(args.workdir, backend.ll)),
+                            backend_key(backend))
+            for stage_key in stage_keys:
+                fp_index.record_stage(stage_key, final)
+            with open(os.path.join(args.workdir, "fingerprints.json"), "w") as f:
+                json.dump({"stages": fingerprints, "final": final}, f, indent=1)
+    print("Compilation complete!")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
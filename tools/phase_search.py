@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""Exhaustive phase-ordering search over the stage blocks of a pipeline script.
+
+The stage blocks named with --groups (all pre-lowering stages by default) are
+permuted in place; every other stage keeps its position.  Orderings that
+violate an --after constraint are skipped, which by default rules out the
+ones that cannot compile (deallocation or linalg-to-loops before
+bufferization).  Each remaining ordering is compiled and benchmarked on a
+pool of workers sized to the machine, and one JSON line per candidate is
+appended to the results log: ordering, compile time, code size and latency.
+Candidates already measured in the log are not run again, so a search can be
+resumed; ones that timed out or failed to benchmark are retried.
+
+Usage:
+  python3 tools/phase_search.py -p o1 --image cat.jpg
+  python3 tools/phase_search.py -p o1 --groups 1,2,3,4 --after 4:1 --jobs 16
+"""
+
+import argparse
+import itertools
+import json
+import os
+import sys
+from concurrent.futures import ThreadPoolExecutor, as_completed
+
+from evaluate import add_evaluator_args, evaluator_from_args
+from pipelines import PIPELINES, stage_label
+
+# Permutable stages and hard ordering constraints ("stage": [stages it must
+# follow]) for each script.  Stages 8-11 of O1/O2 lower to LLVM and stay last.
+DEFAULT_GROUPS = {
+    "o1": ["1", "2", "3", "4", "4b", "5", "6", "7"],
+    "o2": ["1", "2", "3", "4", "4b", "5", "6", "7"],
+    "o1-affine": ["1", "2", "3", "4", "4b", "5", "6", "7"],
+    "o2-affine": ["1", "2", "3", "4", "4b", "5", "6", "7"],
+    "o1-parallel": ["1", "2", "3", "4", "4b", "5", "6", "7"],
+    "o2-parallel": ["1", "2", "3", "4", "4b", "5", "6", "7"],
+    "o2-vector": ["1", "2", "3", "4", "4b", "5", "6", "7"],
+}
+DEFAULT_AFTER = {
+    "o1": {"4b": ["4"], "5": ["4"]},
+    "o2": {"4b": ["4"], "5": ["4"]},
+    "o1-affine": {"4b": ["4"], "5": ["4"]},
+    "o2-affine": {"4b": ["4"], "5": ["4"]},
+    "o1-parallel": {"4b": ["4"], "5": ["4"]},
+    "o2-parallel": {"4b": ["4"], "5": ["4"]},
+    "o2-vector": {"4b": ["4"], "5": ["4"]},
+}
+
+
+def legal(order, after):
+    seen = set()
+    for label in order:
+        if any(dep in order and dep not in seen for dep in after.get(label, ())):
+            return False
+        seen.add(label)
+    return True
+
+
+def orderings(stages, groups, after):
+    """Yield every legal stage list, permuting `groups` within their slots."""
+    by_label = {stage_label(stage): stage for stage in stages}
+    missing = [label for label in groups if label not in by_label]
+    if missing or len(set(groups)) != len(groups):
+        raise ValueError("groups %s do not name distinct stages of the pipeline"
+                         % ",".join(groups))
+    slots = [i for i, stage in enumerate(stages) if stage_label(stage) in groups]
+    for order in itertools.permutations(groups):
+        if not legal(order, after):
+            continue
+        candidate = list(stages)
+        for slot, label in zip(slots, order):
+            candidate[slot] = by_label[label]
+        yield order, candidate
+
+
+def parse_after(values):
+    after = {}
+    for value in values:
+        stage, _, deps = value.partition(":")
+        after.setdefault(stage, []).extend(deps.split(","))
+    return after
+
+
+def load_done(path):
+    """Results in the log that a rerun would only repeat, by candidate name.
+
+    These are the measured ones and the ones that failed to compile (no
+    compile_s), which fail the same way again.  Timeouts, failed benchmarks
+    and candidates pruned against another run's best latency are retried.
+    """
+    done = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                result = json.loads(line)
+                if result["status"] == "ok" or (result["status"] == "failed"
+                                                and "compile_s" not in result):
+                    done[result["name"]] = result
+    return done
+
+
+def print_summary(results, top):
+    ok = [r for r in results if r["status"] == "ok"]
+    key = "latency_ms" if any(r.get("latency_ms") for r in ok) else "compile_s"
+    ok.sort(key=lambda r: r.get(key) or float("inf"))
+    print("\n%-36s %10s %10s %12s" % ("ordering", "latency", "compile", ".text"))
+    for r in ok[:top]:
+        print("%-36s %10s %10.2f %12s" % (
+            " ".join(r["order"]),
+            "%.3f ms" % r["latency_ms"] if r.get("latency_ms") else "-",
+            r["compile_s"], "-" if r.get("text_bytes") is None else r["text_bytes"]))
+    pruned = sum(1 for r in results if r["status"] == "pruned")
+    failed = len(results) - len(ok) - pruned
+    if pruned:
+        print("%d candidates not benchmarked: predicted slow by the cost model" % pruned)
+    if failed:
+        print("%d candidates failed (see the results log)" % failed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-p", "--pipeline", default="o1",
+                        choices=sorted(name for name in PIPELINES if name != "baseline"))
+    parser.add_argument("--groups", help="comma-separated stage numbers to permute")
+    parser.add_argument("--after", action="append", default=[], metavar="S:DEPS",
+                        help="stage S must follow the comma-separated stages DEPS")
+    parser.add_argument("--jobs", type=int, default=os.cpu_count(),
+                        help="concurrent candidates (default: all cores)")
+    parser.add_argument("--bench-jobs", type=int, default=1,
+                        help="concurrent benchmark runs (default: %(default)s)")
+    parser.add_argument("--limit", type=int, help="evaluate at most this many orderings")
+    parser.add_argument("--results", default="search_results.jsonl")
+    parser.add_argument("--top", type=int, default=20)
+    add_evaluator_args(parser)
+    args = parser.parse_args()
+
+    stages = PIPELINES[args.pipeline]
+    groups = args.groups.split(",") if args.groups else DEFAULT_GROUPS[args.pipeline]
+    after = parse_after(args.after) if args.after else DEFAULT_AFTER[args.pipeline]
+    known = {stage_label(stage) for stage in stages}
+    unknown = [g for g in groups if g not in known]
+    if unknown:
+        parser.error("no stage %s in %s" % (", ".join(unknown), args.pipeline))
+    if len(set(groups)) != len(groups):
+        parser.error("--groups names a stage more than once")
+
+    done = load_done(args.results)
+    todo = []
+    for order, candidate in orderings(stages, groups, after):
+        name = "_".join(order)
+        if name not in done:
+            todo.append((name, order, candidate))
+    if args.limit is not None:
+        todo = todo[:args.limit]
+    print("%d legal orderings to evaluate, %d already in %s"
+          % (len(todo), len(done), args.results))
+
+    evaluator = evaluator_from_args(args, bench_jobs=args.bench_jobs)
+    try:
+        evaluator.check_abi(stages)
+    except ValueError as err:
+        parser.error(str(err))
+    evaluator.prepare()
+
+    results = list(done.values())
+    # Workers pull the next ordering from a shared queue as soon as they are
+    # idle.  Orderings are queued in lexicographic order, so candidates that
+    # run side by side tend to share prefixes in the stage cache.
+    with ThreadPoolExecutor(max_workers=args.jobs) as pool, \
+            open(args.results, "a") as log:
+        futures = {pool.submit(evaluator.evaluate, name, candidate, args.pipeline): order
+                   for name, order, candidate in todo}
+        for n, future in enumerate(as_completed(futures), 1):
+            result = future.result()
+            result["order"] = list(futures[future])
+            results.append(result)
+            log.write(json.dumps(result) + "\n")
+            log.flush()
+            print("[%d/%d] %s: %s" % (n, len(todo), result["name"], result["status"]))
+
+    print_summary(results, args.top)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,394 @@
+"""Stage lists of the pipeline scripts, in a form the in-process tools can run.
+
+Every stage mirrors one `mlir-opt` invocation of the corresponding shell
+script: the same title, the same output file name and the same pass flags,
+written exactly as they appear on the command line.  Keep these in sync when
+a script changes.
+"""
+
+import json
+import os
+from collections import namedtuple
+
+Stage = namedtuple("Stage", ["title", "output", "passes"])
+
+# Passes anchored on func.func.  mlir-opt nests them implicitly on the command
+# line; a textual pass pipeline has to nest them explicitly.
+FUNC_PASSES = {
+    "affine-loop-fusion",
+    "affine-loop-tile",
+    "affine-loop-invariant-code-motion",
+    "affine-loop-unroll",
+    "affine-scalrep",
+    "affine-super-vectorize",
+    "affine-parallelize",
+}
+
+
+def stage_label(stage):
+    """Stage number as the script prints it: "5", "4b", ..."""
+    return stage.title.split(":")[0].split()[-1]
+
+
+BASELINE = [
+    Stage("Stage 1: Initial canonicalization...", "step1.mlir", [
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 2: Bufferization...", "step2.mlir", [
+        '--one-shot-bufferize="bufferize-function-boundaries"',
+    ]),
+    Stage("Stage 3: Convert linalg to loops...", "step3.mlir", [
+        "--convert-linalg-to-loops",
+        "--convert-scf-to-cf",
+    ]),
+    Stage("Stage 4: Lower to LLVM dialect...", "alexnet_llvm_dialect.mlir", [
+        "--lower-affine",
+        "--expand-strided-metadata",
+        '--finalize-memref-to-llvm="use-generic-functions=1"',
+        "--convert-arith-to-llvm",
+        "--convert-func-to-llvm",
+        "--convert-cf-to-llvm",
+        "--reconcile-unrealized-casts",
+    ]),
+]
+
+O1 = [
+    Stage("Stage 1: Canonicalization and CSE...", "step1_canon.mlir", [
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 2: Linalg optimizations...", "step2_linalg_opt.mlir", [
+        "--linalg-fuse-elementwise-ops",
+        "--linalg-fold-unit-extent-dims",
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 3: Tiling and vectorization prep...", "step3_generalized.mlir", [
+        "--linalg-generalize-named-ops",
+        "--linalg-fuse-elementwise-ops",
+        "--canonicalize",
+    ]),
+    Stage("Stage 4: Bufferization...", "step4_bufferized.mlir", [
+        '--one-shot-bufferize="bufferize-function-boundaries function-boundary-type-conversion=identity-layout-map"',
+        '--buffer-results-to-out-params="hoist-static-allocs"',
+        "--canonicalize",
+    ]),
+    Stage("Stage 4b: Lower deallocations...", "step4_dealloc.mlir", [
+        "--buffer-deallocation-pipeline",
+        "--canonicalize",
+    ]),
+    Stage("Stage 5: Convert linalg to loops...", "step5_loops.mlir", [
+        "--convert-linalg-to-loops",
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 6: Loop optimizations...", "step6_loop_opt.mlir", [
+        "--loop-invariant-code-motion",
+        "--affine-loop-fusion",
+        '--affine-loop-tile="tile-sizes=32 tile-sizes=32"',
+        "--canonicalize",
+    ]),
+    Stage("Stage 7: SCF optimizations...", "step7_scf_opt.mlir", [
+        "--scf-for-loop-peeling",
+        "--scf-for-loop-canonicalization",
+        "--canonicalize",
+    ]),
+    Stage("Stage 8: Convert SCF to CF...", "step8_cf.mlir", [
+        "--convert-scf-to-cf",
+        "--canonicalize",
+    ]),
+    Stage("Stage 9: Affine and memref optimizations...", "step9_affine_lowered.mlir", [
+        "--lower-affine",
+        "--normalize-memrefs",
+        "--memref-expand",
+        "--fold-memref-alias-ops",
+        "--canonicalize",
+    ]),
+    Stage("Stage 10: Arithmetic optimizations...", "step10_arith_opt.mlir", [
+        "--arith-expand",
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 11: Lower to LLVM dialect...", "step11_llvm_dialect.mlir", [
+        "--lower-affine",
+        "--expand-strided-metadata",
+        '--finalize-memref-to-llvm="use-generic-functions=1"',
+        "--lower-affine",
+        "--convert-arith-to-llvm",
+        "--convert-cf-to-llvm",
+        '--convert-func-to-llvm="use-bare-ptr-memref-call-conv=1"',
+        "--reconcile-unrealized-casts",
+        "--canonicalize",
+    ]),
+]
+
+O2 = [
+    Stage("Stage 1: Initial canonicalization...", "vec_step1.mlir", [
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 2: Fuse elementwise operations...", "vec_step2.mlir", [
+        "--linalg-fuse-elementwise-ops",
+        "--linalg-fold-unit-extent-dims",
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 3: Generalize named ops...", "vec_step3.mlir", [
+        "--linalg-generalize-named-ops",
+        "--canonicalize",
+    ]),
+    Stage("Stage 4: Bufferize...", "vec_step4_bufferized.mlir", [
+        '--one-shot-bufferize="bufferize-function-boundaries function-boundary-type-conversion=identity-layout-map"',
+        '--buffer-results-to-out-params="hoist-static-allocs"',
+        "--canonicalize",
+    ]),
+    Stage("Stage 4b: Lower deallocations...", "vec_step4_dealloc.mlir", [
+        "--buffer-deallocation-pipeline",
+        "--canonicalize",
+    ]),
+    Stage("Stage 5: Lower linalg to loops...", "vec_step5_loops.mlir", [
+        "--convert-linalg-to-loops",
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 6: Affine optimizations...", "vec_step6_affine_opt.mlir", [
+        "--loop-invariant-code-motion",
+        "--affine-loop-fusion",
+        '--affine-loop-tile="tile-size=32"',
+        "--canonicalize",
+        "--cse",
+    ]),
+    Stage("Stage 7: SCF optimizations...", "vec_step7_scf_opt.mlir", [
+        "--scf-for-loop-peeling",
+        "--canonicalize",
+    ]),
+    Stage("Stage 8: Lower SCF to CF...", "vec_step8_cf.mlir", [
+        "--convert-scf-to-cf",
+        "--canonicalize",
+    ]),
+    Stage("Stage 9: Lower affine...", "vec_step9_lowered.mlir", [
+        "--lower-affine",
+        "--normalize-memrefs",
+        "--memref-expand",
+        "--fold-memref-alias-ops",
+        "--canonicalize",
+    ]),
+    Stage("Stage 10: Expand metadata and lower affine...", "vec_step10_expanded.mlir", [
+        "--expand-strided-metadata",
+        "--lower-affine",
+        "--canonicalize",
+    ]),
+    Stage("Stage 11: Convert to LLVM dialect...", "vec_step11_llvm.mlir", [
+        '--finalize-memref-to-llvm="use-generic-functions=1"',
+        "--convert-arith-to-llvm",
+        "--convert-cf-to-llvm",
+        '--convert-func-to-llvm="use-bare-ptr-memref-call-conv=1"',
+        "--reconcile-unrealized-casts",
+        "--canonicalize",
+    ]),
+]
+
+def affine_variant(stages):
+    """The --affine path of O1/O2_pipeline.sh: linalg is lowered to affine.for in
+    Stage 5, and affine is lowered ahead of the SCF to CF conversion."""
+    out = []
+    for stage in stages:
+        passes = ["--convert-linalg-to-affine-loops" if p == "--convert-linalg-to-loops"
+                  else p for p in stage.passes]
+        if "--convert-scf-to-cf" in passes:
+            passes.insert(passes.index("--convert-scf-to-cf"), "--lower-affine")
+        out.append(stage._replace(passes=passes))
+    return out
+
+
+def parallel_variant(stages):
+    """The --parallel path of O1/O2_pipeline.sh: linalg is lowered to
+    scf.parallel, scf.parallel to OpenMP, and OpenMP to LLVM with the rest."""
+    out = []
+    for stage in stages:
+        passes = ["--convert-linalg-to-parallel-loops" if p == "--convert-linalg-to-loops"
+                  else p for p in stage.passes]
+        if "--convert-scf-to-cf" in passes:
+            passes.insert(passes.index("--convert-scf-to-cf"), "--convert-scf-to-openmp")
+        if "--reconcile-unrealized-casts" in passes:
+            passes.insert(passes.index("--reconcile-unrealized-casts"),
+                          "--convert-openmp-to-llvm")
+        out.append(stage._replace(passes=passes))
+    return out
+
+
+# Transform script of the --vector path of O2_pipeline.sh.
+VECTORIZE_SCRIPT = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                                "Optimized_Pipeline_2", "transforms", "vectorize_avx2.mlir")
+
+
+def vector_variant(stages):
+    """The --vector path of O2_pipeline.sh: Stage 1b tiles and vectorizes with
+    the transform script; the vector dialect is lowered in Stages 8 and 11."""
+    out = []
+    for stage in stages:
+        passes = list(stage.passes)
+        if "--convert-scf-to-cf" in passes:
+            passes.insert(passes.index("--convert-scf-to-cf"), "--convert-vector-to-scf")
+        lower = [i for i, p in enumerate(passes) if p.startswith("--finalize-memref-to-llvm")]
+        if lower:
+            passes.insert(lower[0], "--convert-vector-to-llvm=enable-x86vector=true")
+        out.append(stage._replace(passes=passes))
+        if stage_label(stage) == "1":
+            base = os.path.splitext(stage.output)[0]
+            out.append(Stage("Stage 1b: Tile and vectorize convolutions and matmuls...",
+                             base + "b_vectorized.mlir", [
+                '--transform-preload-library="transform-library-paths=%s"' % VECTORIZE_SCRIPT,
+                "--transform-interpreter",
+                "--canonicalize",
+            ]))
+    return out
+
+
+O1_AFFINE = affine_variant(O1)
+O2_AFFINE = affine_variant(O2)
+O1_PARALLEL = parallel_variant(O1)
+O2_PARALLEL = parallel_variant(O2)
+O2_VECTOR = vector_variant(O2)
+
+# Stages 12-14 of each script: translation to LLVM IR and the LLVM tools.
+# "ll" is the mlir-translate output, "opt_passes" is None when the script does
+# not run opt, and "llc" is a list of (flags, output) invocations.
+Backend = namedtuple("Backend", ["ll", "opt_passes", "opt_output", "llc"])
+
+BACKENDS = {
+    "baseline": Backend(
+        ll="alexnet.ll",
+        opt_passes=None,
+        opt_output=None,
+        llc=[(["-filetype=obj", "-relocation-model=pic"], "alexnet.o")],
+    ),
+    "o1": Backend(
+        ll="alexnet.ll",
+        opt_passes="loop-vectorize,slp-vectorizer,load-store-vectorizer",
+        opt_output="alexnet_opt.bc",
+        llc=[
+            (["-O3", "-march=x86-64", "-mcpu=native", "-enable-unsafe-fp-math",
+              "-mattr=+avx2,+fma"], "alexnet.s"),
+            (["-O3", "-march=x86-64", "-mcpu=native", "-filetype=obj"], "alexnet.o"),
+        ],
+    ),
+    "o2": Backend(
+        ll="alexnet_vectorized.ll",
+        opt_passes="default<O3>,loop-vectorize,slp-vectorizer,load-store-vectorizer",
+        opt_output="alexnet_vectorized.bc",
+        llc=[
+            (["-O3", "-march=x86-64", "-mcpu=native", "-relocation-model=pic",
+              "-enable-unsafe-fp-math", "-fp-contract=fast",
+              "-mattr=+avx2,+fma,+f16c"], "alexnet_vectorized.s"),
+        ],
+    ),
+}
+
+BACKENDS["o1-affine"] = BACKENDS["o1"]
+BACKENDS["o2-affine"] = BACKENDS["o2"]
+BACKENDS["o1-parallel"] = BACKENDS["o1"]
+BACKENDS["o2-parallel"] = BACKENDS["o2"]
+BACKENDS["o2-vector"] = BACKENDS["o2"]
+
+PIPELINES = {
+    "baseline": BASELINE,
+    "o1": O1,
+    "o2": O2,
+    "o1-affine": O1_AFFINE,
+    "o2-affine": O2_AFFINE,
+    "o1-parallel": O1_PARALLEL,
+    "o2-parallel": O2_PARALLEL,
+    "o2-vector": O2_VECTOR,
+}
+
+
+def parse_pass_flag(flag):
+    """Split a command-line pass flag into its name and (key, value) options.
+
+    `--affine-loop-tile="tile-sizes=32 tile-sizes=32"` becomes
+    ("affine-loop-tile", [("tile-sizes", "32"), ("tile-sizes", "32")]).
+    Flag-style options without a value get None.
+    """
+    flag = flag.strip().lstrip("-")
+    name, sep, opts = flag.partition("=")
+    options = []
+    if sep:
+        for opt in opts.strip().strip("\"'").split():
+            key, eq, value = opt.partition("=")
+            options.append((key, value if eq else None))
+    return name, options
+
+
+def entry_abi(stages):
+    """How the compiled alexnet takes and returns its tensors.
+
+    "bare": bare pointers, logits written to the caller's buffer (O1, O2).
+    "descriptor": memref descriptors, logits written to the caller's buffer
+    (O1/O2 with the default convert-func-to-llvm, e.g. --dynamic-batch).
+    "returned": memref descriptors, logits returned (the baseline).
+    """
+    flags = dict(parse_pass_flag(p) for stage in stages for p in stage.passes)
+    if "buffer-results-to-out-params" not in flags:
+        return "returned"
+    if dict(flags.get("convert-func-to-llvm") or []).get("use-bare-ptr-memref-call-conv") == "1":
+        return "bare"
+    return "descriptor"
+
+
+def pipeline_element(flag):
+    """Textual-pipeline form of one pass flag, e.g. `affine-loop-tile{tile-sizes=32,32}`.
+
+    Repeated list options are merged the same way mlir-opt's command line
+    accumulates them, and options are sorted so equivalent spellings of a
+    flag give the same text.
+    """
+    name, options = parse_pass_flag(flag)
+    element = name
+    merged = {}
+    for key, value in options:
+        if value is None:
+            merged[key] = None
+        elif merged.get(key) is not None:
+            merged[key] += "," + value
+        else:
+            merged[key] = value
+    if merged:
+        body = " ".join(k if v is None else "%s=%s" % (k, v)
+                        for k, v in sorted(merged.items()))
+        element = "%s{%s}" % (name, body)
+    if name in FUNC_PASSES:
+        return "func.func(%s)" % element
+    return element
+
+
+def pass_pipeline(passes):
+    """Textual pipeline anchored on builtin.module for a list of pass flags."""
+    return "builtin.module(%s)" % ",".join(pipeline_element(p) for p in passes)
+
+
+def write_spec(path, stages, backend, opt_passes=None):
+    """Save a candidate pipeline: its stages plus the script whose backend it uses.
+
+    `opt_passes` overrides the backend's Stage 13 `opt -passes=` list.
+    """
+    spec = {
+        "backend": backend,
+        "stages": [stage._asdict() for stage in stages],
+    }
+    if opt_passes is not None:
+        spec["opt_passes"] = opt_passes
+    with open(path, "w") as f:
+        json.dump(spec, f, indent=1)
+
+
+def read_spec(path):
+    """Load a spec written by write_spec: (stages, Backend)."""
+    with open(path) as f:
+        spec = json.load(f)
+    stages = [Stage(**stage) for stage in spec["stages"]]
+    backend = BACKENDS[spec["backend"]]
+    if "opt_passes" in spec:
+        backend = backend._replace(opt_passes=spec["opt_passes"])
+    return stages, backend
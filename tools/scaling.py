@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Thread scaling curve of an OpenMP pipeline variant.
+
+Builds the pipeline once (o1-parallel by default: the --parallel path of
+O1_pipeline.sh), links it with the benchmark driver and runs it with 1..N
+threads through the driver's thread-count argument.  Prints the average and
+minimum latency, speedup over one thread and parallel efficiency for each
+count, and writes them to --output.
+
+Usage:
+  python3 tools/scaling.py --image cat.jpg
+  python3 tools/scaling.py -p o2-parallel --image cat.jpg --counts 1,2,4,8,16,32
+"""
+
+import argparse
+import json
+import os
+import sys
+
+from evaluate import add_evaluator_args, evaluator_from_args
+from pipelines import PIPELINES
+
+
+def default_counts(limit):
+    counts, n = [], 1
+    while n < limit:
+        counts.append(n)
+        n *= 2
+    return counts + [limit]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-p", "--pipeline", default="o1-parallel",
+                        choices=sorted(p for p in PIPELINES if p.endswith("-parallel")))
+    parser.add_argument("--counts", help="comma-separated thread counts "
+                                         "(default: powers of two up to --max-threads)")
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count())
+    parser.add_argument("-o", "--output", default="scaling.json")
+    add_evaluator_args(parser)
+    args = parser.parse_args()
+    if not args.image:
+        parser.error("--image is required")
+    counts = sorted(int(c) for c in args.counts.split(",")) if args.counts \
+        else default_counts(args.max_threads)
+
+    evaluator = evaluator_from_args(args)
+    evaluator.prepare()
+    workdir = os.path.join(evaluator.workroot, "scaling_" + args.pipeline)
+    os.makedirs(workdir, exist_ok=True)
+    print("Building %s in %s..." % (args.pipeline, workdir))
+    obj = evaluator.compile(workdir, PIPELINES[args.pipeline], args.pipeline, dedup=False)
+    binary = evaluator.link(workdir, obj)
+
+    rows = []
+    for threads in counts:
+        avg, best = evaluator.run(binary, threads)
+        if avg is None:
+            sys.exit("no latency in the output of %s with %d threads" % (binary, threads))
+        rows.append({"threads": threads, "latency_ms": avg, "min_ms": best})
+        print("  %3d threads: %.3f ms" % (threads, avg))
+
+    # Speedup is relative to the smallest count, normally one thread.
+    base, base_threads = rows[0]["latency_ms"], rows[0]["threads"]
+    print("\n%8s %12s %12s %9s %11s" % ("threads", "average", "min", "speedup", "efficiency"))
+    for r in rows:
+        r["speedup"] = round(base / r["latency_ms"], 3)
+        r["efficiency"] = round(r["speedup"] * base_threads / r["threads"], 3)
+        print("%8d %9.3f ms %9.3f ms %8.2fx %10.0f%%" % (
+            r["threads"], r["latency_ms"], r["min_ms"] or 0.0, r["speedup"],
+            100 * r["efficiency"]))
+
+    with open(args.output, "w") as f:
+        json.dump({"pipeline": args.pipeline, "curve": rows}, f, indent=1)
+    print("Wrote %s" % args.output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
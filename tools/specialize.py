@@ -0,0 +1,335 @@
+#!/usr/bin/env python3
+"""Batch-specialized versions of alexnet behind a generated dispatcher.
+
+A dynamic batch (model.py --dynamic-batch) leaves every loop over the batch
+with an unknown trip count, so the tiler and vectorizer lose the exact
+bounds they get from a static export.  `build` compiles one static export
+per batch size (1, 4, 16 and 64 by default) with the same pipeline.  It
+renames the entry point of each object to alexnet_b<N> and links them with
+a generated dispatcher, alexnet_dispatch.c, into one relocatable alexnet.o.
+
+The dispatcher defines `alexnet` with the descriptor ABI of a dynamic-batch
+model (see batching.py), so main.c built with -DALEXNET_DYNAMIC_BATCH links
+against it unchanged.  For a batch of n images it picks the sequence of
+versions with the lowest total cost that covers n.  It splits the batch
+across calls and pads the last call with zero images when a larger version
+is cheaper than several small ones.  Ties go to the larger version, so to
+fewer calls.  Costs are the latencies `build` measured for each version when
+given --image.  Without an image, each version costs its batch size plus
+CALL_OVERHEAD images, the fixed cost of one call (mostly streaming the fc
+weights once), so a batch of exactly N runs as one call on alexnet_b<N>.
+`build` checks that plan before writing the dispatcher.
+
+Padded calls go through one scratch batch per version, allocated on first
+use and kept, so steady-state calls do not touch the heap.  Like the arena
+of memory_plan.py, this makes the dispatcher single-caller.
+
+Every version embeds its own copy of the weights unless the exports were
+externalized (model.py --external-weights); those share alexnet_weights.
+
+Usage:
+  python3 tools/specialize.py build -p o1 -i alexnet_linalg_b{batch}.mlir --export --image cat.jpg
+  python3 tools/specialize.py build -p o2 -i alexnet_linalg_b{batch}.mlir --batches 1,8,32 --bench 1,3,20,100
+  clang -O3 -DALEXNET_DYNAMIC_BATCH main.c specialized/alexnet.o -lm -fopenmp -o alexnet_infer
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+
+from batching import DEFAULT_BATCHES, export, input_batch, measure
+from pipelines import PIPELINES
+
+ENTRY = "alexnet"
+# Modeled cost of one call in images, on top of one per image in the batch.
+CALL_OVERHEAD = 1.0
+
+DISPATCH_TEMPLATE = r"""/* Generated by tools/specialize.py: dispatcher over batch-specialized
+ * versions of alexnet.  Do not edit. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_ELEMS (3 * 224 * 224)
+#define NUM_CLASSES 1000
+#define NUM_VERSIONS %(count)d
+#define MAX_BATCH %(max_batch)d
+
+%(externs)s
+
+typedef struct {
+    int64_t batch;
+    double cost;  /* %(cost_unit)s per call */
+    void (*run)(const float *input, float *logits);
+} Version;
+
+static const Version versions[NUM_VERSIONS] = {
+%(table)s
+};
+
+/* Padded input and logits of each version, allocated on its first padded
+ * call and kept for the life of the process. */
+typedef struct {
+    float *input;
+    float *logits;
+} Scratch;
+
+static Scratch scratch[NUM_VERSIONS];
+
+static Scratch *version_scratch(const Version *v) {
+    Scratch *s = &scratch[v - versions];
+    if (s->input == NULL) {
+        if (posix_memalign((void **)&s->input, 64, sizeof(float) * IMAGE_ELEMS * v->batch) != 0 ||
+            posix_memalign((void **)&s->logits, 64, sizeof(float) * NUM_CLASSES * v->batch) != 0) {
+            fprintf(stderr, "alexnet: failed to allocate a padded batch of %%lld\n",
+                    (long long)v->batch);
+            abort();
+        }
+    }
+    return s;
+}
+
+/* Runs `n` images starting at `input` through version `v`, padding with zero
+ * images when the version is larger than `n`. */
+static void run_chunk(const Version *v, const float *input, float *logits, int64_t n) {
+    if (n == v->batch) {
+        v->run(input, logits);
+        return;
+    }
+    Scratch *s = version_scratch(v);
+    memcpy(s->input, input, sizeof(float) * IMAGE_ELEMS * n);
+    memset(s->input + IMAGE_ELEMS * n, 0, sizeof(float) * IMAGE_ELEMS * (v->batch - n));
+    v->run(s->input, s->logits);
+    memcpy(logits, s->logits, sizeof(float) * NUM_CLASSES * n);
+}
+
+/* Cheapest cover of `n` images: plan[k] is the version that starts the best
+ * plan for k remaining images.  Ties go to the larger version (fewer calls).
+ * Beyond 2 * MAX_BATCH the largest version is taken greedily, so the table
+ * stays small.  plan() in specialize.py mirrors this. */
+static void plan_batch(int64_t n, int *plan) {
+    double best[2 * MAX_BATCH + 1];
+    best[0] = 0.0;
+    for (int64_t k = 1; k <= n && k <= 2 * MAX_BATCH; k++) {
+        best[k] = -1.0;
+        for (int i = 0; i < NUM_VERSIONS; i++) {
+            int64_t rest = k > versions[i].batch ? k - versions[i].batch : 0;
+            double cost = versions[i].cost + best[rest];
+            if (best[k] < 0.0 || cost <= best[k]) {
+                best[k] = cost;
+                plan[k] = i;
+            }
+        }
+    }
+}
+
+void alexnet(const float *in_allocated, const float *in_aligned, int64_t in_offset,
+             int64_t in_n, int64_t in_c, int64_t in_h, int64_t in_w,
+             int64_t in_sn, int64_t in_sc, int64_t in_sh, int64_t in_sw,
+             float *out_allocated, float *out_aligned, int64_t out_offset,
+             int64_t out_n, int64_t out_k, int64_t out_sn, int64_t out_sk) {
+    (void)in_allocated;
+    (void)out_allocated;
+    if (in_c * in_h * in_w != IMAGE_ELEMS || in_sn != IMAGE_ELEMS || in_sc != in_h * in_w ||
+        in_sh != in_w || in_sw != 1 || out_n != in_n || out_k != NUM_CLASSES ||
+        out_sn != NUM_CLASSES || out_sk != 1) {
+        fprintf(stderr, "alexnet: the specialized versions need dense NCHW input and logits\n");
+        abort();
+    }
+    const float *input = in_aligned + in_offset;
+    float *logits = out_aligned + out_offset;
+    int plan[2 * MAX_BATCH + 1];
+    int verbose = getenv("ALEXNET_DISPATCH_VERBOSE") != NULL;
+
+    for (int64_t left = in_n; left > 0;) {
+        const Version *v = &versions[NUM_VERSIONS - 1];
+        if (left <= 2 * MAX_BATCH) {
+            plan_batch(left, plan);
+            v = &versions[plan[left]];
+        }
+        int64_t n = left < v->batch ? left : v->batch;
+        if (verbose) {
+            fprintf(stderr, "alexnet: %%lld image(s) on alexnet_b%%lld\n", (long long)n,
+                    (long long)v->batch);
+        }
+        run_chunk(v, input, logits, n);
+        input += IMAGE_ELEMS * n;
+        logits += NUM_CLASSES * n;
+        left -= n;
+    }
+}
+"""
+
+
+def plan(costs, n):
+    """Batch sizes of the calls the dispatcher makes for `n` images."""
+    batches = sorted(costs)
+    largest = batches[-1]
+    calls = []
+    while n > 0:
+        if n > 2 * largest:
+            calls.append(largest)
+            n -= largest
+            continue
+        best, first = [0.0], [None]
+        for k in range(1, n + 1):
+            best.append(None)
+            first.append(None)
+            for b in batches:
+                cost = costs[b] + best[max(k - b, 0)]
+                if best[k] is None or cost <= best[k]:
+                    best[k], first[k] = cost, b
+        calls.append(first[n])
+        n -= min(n, first[n])
+    return calls
+
+
+def check_plan(costs):
+    """Exits unless a batch of exactly N runs as one call on alexnet_b<N>."""
+    for batch in sorted(costs):
+        calls = plan(costs, batch)
+        if calls != [batch]:
+            sys.exit("dispatch plan for %d image(s) is %s, expected alexnet_b%d"
+                     % (batch, " + ".join("alexnet_b%d" % b for b in calls), batch))
+
+
+def dispatcher(costs, unit):
+    """Source of alexnet_dispatch.c for {batch: cost per call}."""
+    batches = sorted(costs)
+    return DISPATCH_TEMPLATE % {
+        "count": len(batches),
+        "max_batch": batches[-1],
+        "externs": "\n".join("extern void %s_b%d(const float *input, float *logits);"
+                             % (ENTRY, b) for b in batches),
+        "cost_unit": unit,
+        "table": "\n".join("    {%d, %r, %s_b%d}," % (b, float(costs[b]), ENTRY, b)
+                           for b in batches),
+    }
+
+
+def rename_entry(obj, out, batch):
+    """Copy of `obj` whose entry point is alexnet_b<batch>."""
+    subprocess.run(["objcopy", "--redefine-sym", "%s=%s_b%d" % (ENTRY, ENTRY, batch),
+                    obj, out], check=True)
+    return out
+
+
+def build_versions(args):
+    """Compiles every batch; returns ({batch: renamed object}, {batch: cost}, unit)."""
+    from evaluate import evaluator_from_args
+
+    stages = PIPELINES[args.pipeline]
+    template = args.input
+    objects, costs = {}, {}
+    for batch in args.batches:
+        args.input = template.format(batch=batch)
+        if not os.path.exists(args.input) and args.export:
+            export(args.input, batch)
+        if input_batch(args.input) != batch:
+            sys.exit("%s does not have batch %d" % (args.input, batch))
+        evaluator = evaluator_from_args(args)
+        workdir = os.path.join(evaluator.workroot, "specialize_%s_%d" % (args.pipeline, batch))
+        os.makedirs(workdir, exist_ok=True)
+        print("Building %s with batch %d..." % (args.pipeline, batch))
+        obj = evaluator.compile(workdir, stages, args.pipeline, dedup=False)
+        objects[batch] = rename_entry(obj, os.path.join(args.output, "%s_b%d.o"
+                                                        % (ENTRY, batch)), batch)
+        if args.image:
+            # Timed with the driver built for this batch, before the rename.
+            evaluator.cflags.append("-DBATCH=%d" % batch)
+            evaluator.prepare()
+            row = measure(evaluator, evaluator.link(workdir, obj), batch)
+            costs[batch] = row["latency_ms"]
+            print("  batch %d: %.3f ms, %.2f images/s" % (batch, row["latency_ms"],
+                                                          row["images_per_s"]))
+        else:
+            costs[batch] = batch + CALL_OVERHEAD
+    args.input = template
+    return objects, costs, "ms" if args.image else "images"
+
+
+def link(args, objects, costs, unit):
+    """alexnet_dispatch.c and one relocatable alexnet.o holding every version."""
+    from evaluate import evaluator_from_args
+
+    source = os.path.join(args.output, "alexnet_dispatch.c")
+    with open(source, "w") as f:
+        f.write(dispatcher(costs, unit))
+    evaluator = evaluator_from_args(args)
+    dispatch_obj = os.path.join(args.output, "alexnet_dispatch.o")
+    subprocess.run([evaluator.cc] + evaluator.cflags + ["-c", source, "-o", dispatch_obj],
+                   check=True)
+    combined = os.path.join(args.output, "%s.o" % ENTRY)
+    subprocess.run(["ld", "-r", "-o", combined, dispatch_obj]
+                   + [objects[b] for b in sorted(objects)], check=True)
+    with open(os.path.join(args.output, "versions.json"), "w") as f:
+        json.dump({"pipeline": args.pipeline, "cost_unit": unit,
+                   "versions": [{"batch": b, "cost": costs[b]} for b in sorted(costs)]},
+                  f, indent=1)
+    print("Wrote %s and %s" % (source, combined))
+    return combined
+
+
+def bench(args, combined):
+    """images/s of the dispatched model at each batch in --bench."""
+    from evaluate import evaluator_from_args
+
+    evaluator = evaluator_from_args(args)
+    evaluator.cflags.append("-DALEXNET_DYNAMIC_BATCH")
+    evaluator.prepare()
+    workdir = os.path.join(evaluator.workroot, "specialize_%s_dispatch" % args.pipeline)
+    os.makedirs(workdir, exist_ok=True)
+    binary = evaluator.link(workdir, combined)
+    rows = []
+    for batch in args.bench:
+        rows.append(measure(evaluator, binary, batch, env={"ALEXNET_BATCH": str(batch)}))
+    print("\n%6s %14s %14s %12s" % ("batch", "per call", "per image", "images/s"))
+    for r in rows:
+        print("%6d %11.3f ms %11.3f ms %12.2f" % (r["batch"], r["latency_ms"],
+                                                  r["per_image_ms"], r["images_per_s"]))
+    return rows
+
+
+def main():
+    from evaluate import add_evaluator_args
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("build", help="compile the versions and link them with a dispatcher")
+    p.add_argument("-p", "--pipeline", default="o1",
+                   choices=sorted(name for name in PIPELINES if name != "baseline"))
+    p.add_argument("--batches", default=",".join(map(str, DEFAULT_BATCHES)),
+                   help="comma-separated batch sizes to specialize for (default %(default)s)")
+    p.add_argument("--export", action="store_true",
+                   help="export missing static batches with model.py (needs torch)")
+    p.add_argument("--bench", metavar="BATCHES",
+                   help="with --image, also run the dispatched model at these batch sizes")
+    p.add_argument("-o", "--output", default="specialized",
+                   help="directory for alexnet.o, alexnet_dispatch.c and versions.json")
+    add_evaluator_args(p)
+    args = parser.parse_args()
+    if "{batch}" not in args.input:
+        parser.error("-i needs a {batch} placeholder, e.g. alexnet_linalg_b{batch}.mlir")
+    if args.bench and not args.image:
+        parser.error("--bench needs --image")
+    if not shutil.which("objcopy"):
+        sys.exit("objcopy (binutils) is required to rename the entry points")
+    args.batches = sorted(int(b) for b in args.batches.split(","))
+    args.bench = sorted(int(b) for b in args.bench.split(",")) if args.bench else []
+    os.makedirs(args.output, exist_ok=True)
+
+    objects, costs, unit = build_versions(args)
+    if not args.image:
+        check_plan(costs)
+    combined = link(args, objects, costs, unit)
+    if args.bench:
+        bench(args, combined)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,97 @@
+"""Content-addressed cache of pipeline stage outputs.
+
+The cache is a prefix trie on local disk.  The root of each trie is named by
+the SHA-256 of the input IR; every level below it is one pass, named by the
+hash of its normalized textual form.  A node may hold a bytecode snapshot of
+the module after the passes on its path:
+
+  <cache>/<input-hash>/<pass-hash>/<pass-hash>/.../ir.mlirbc
+                                              .../pass  (normalized pass)
+
+Two orderings that share a prefix share the trie path, so a new ordering is
+resumed from the deepest snapshot on its path and only the passes after it
+are run.  Snapshots are written by the driver at stage boundaries.
+"""
+
+import hashlib
+import os
+
+from pipelines import parse_pass_flag, pipeline_element
+
+SNAPSHOT = "ir.mlirbc"
+# Pass options naming files the pass reads (comma-separated).
+FILE_OPTIONS = ("transform-library-paths",)
+
+
+def _file_key(path):
+    return "sha256:" + hash_file(path)[:16] if os.path.isfile(path) else path
+
+
+def normalize_pass(flag):
+    """Canonical text of a pass flag: dashes, quoting and option order removed.
+
+    Files named by FILE_OPTIONS are replaced by the hash of their contents, so
+    keys neither depend on the checkout location nor survive an edit.
+    """
+    name, options = parse_pass_flag(flag)
+    if any(key in FILE_OPTIONS for key, _ in options):
+        options = [(key, ",".join(_file_key(p) for p in value.split(","))
+                    if key in FILE_OPTIONS and value else value) for key, value in options]
+        flag = '--%s="%s"' % (name, " ".join(key if value is None else "%s=%s" % (key, value)
+                                             for key, value in options))
+    return pipeline_element(flag)
+
+
+def _digest(text):
+    return hashlib.sha256(text.encode()).hexdigest()[:16]
+
+
+def hash_file(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        for chunk in iter(lambda: f.read(1 << 20), b""):
+            h.update(chunk)
+    return h.hexdigest()
+
+
+class StageCache:
+    def __init__(self, root):
+        self.root = root
+
+    def node(self, input_key, passes):
+        parts = [self.root, input_key] + [_digest(normalize_pass(p)) for p in passes]
+        return os.path.join(*parts)
+
+    def snapshot(self, input_key, passes):
+        """Path of the snapshot after `passes`, or None when there is none."""
+        path = os.path.join(self.node(input_key, passes), SNAPSHOT)
+        return path if os.path.exists(path) else None
+
+    def lookup(self, input_key, passes):
+        """Deepest cached prefix of `passes`: (number of passes, snapshot path).
+
+        Returns (0, None) when nothing on the path is cached.
+        """
+        best = (0, None)
+        node = os.path.join(self.root, input_key)
+        for depth, flag in enumerate(passes, 1):
+            node = os.path.join(node, _digest(normalize_pass(flag)))
+            if not os.path.isdir(node):
+                break
+            path = os.path.join(node, SNAPSHOT)
+            if os.path.exists(path):
+                best = (depth, path)
+        return best
+
+    def store(self, input_key, passes, module):
+        """Snapshot `module` as the result of running `passes` on the input."""
+        node = self.node(input_key, passes)
+        os.makedirs(node, exist_ok=True)
+        if passes:
+            with open(os.path.join(node, "pass"), "w") as f:
+                f.write(normalize_pass(passes[-1]) + "\n")
+        # Write under a private name first: parallel searches share the cache.
+        tmp = os.path.join(node, "%s.%d.tmp" % (SNAPSHOT, os.getpid()))
+        with open(tmp, "wb") as f:
+            module.operation.write_bytecode(f)
+        os.replace(tmp, os.path.join(node, SNAPSHOT))
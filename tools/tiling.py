@@ -0,0 +1,409 @@
+#!/usr/bin/env python3
+"""Per-loop-nest tile sizes for the convolution and fully-connected layers.
+
+O1/O2 tile every loop nest with the same `--affine-loop-tile` size, although
+conv1 (11x11 kernel, stride 4) and fc6 (9216x4096) have nothing in common.
+This module tiles each nest on its own instead:
+
+- loop_nests() finds the contractions left after bufferization (three
+  reduction loops: a convolution, one: a matmul) and names them in network
+  order, conv1..conv5 then fc6..fc8.
+- model_tile_sizes() picks, per nest, the tile with the best flops-per-byte
+  ratio whose footprint fits a fraction of one cache level.  Cache sizes are
+  read from sysfs.
+- `sweep` benchmarks neighbours of the model's choice, one nest at a time.
+
+Sizes are saved in a config file.  `phase_driver.py --tile-config` (and
+with_tile_config()) turns a config into a `--tile-loop-nests` step at the
+start of the linalg-to-loops stage.  The driver runs that step through the
+transform dialect, and the fixed `--affine-loop-tile` flags are dropped.
+
+Usage:
+  python3 tools/tiling.py caches
+  python3 tools/tiling.py model -p o1 -i alexnet_linalg.mlir -o tiles.json
+  python3 tools/tiling.py sweep -p o1 -i alexnet_linalg.mlir --image cat.jpg -o tiles.json
+  python3 tools/phase_driver.py -p o1 --tile-config tiles.json
+"""
+
+import argparse
+import glob
+import itertools
+import json
+import os
+import sys
+
+from pipelines import PIPELINES, parse_pass_flag
+
+TILE_PASS = "tile-loop-nests"
+TAG = "tile_nest"
+# Stage that receives the tiling step: tiling needs linalg ops on buffers.
+LOWERING_PASSES = ("convert-linalg-to-loops", "convert-linalg-to-affine-loops")
+
+DEFAULT_CACHES = {"L1d": 32 << 10, "L2": 1 << 20, "L3": 32 << 20}
+ELEMENT_BYTES = {"f64": 8, "i64": 8, "f32": 4, "i32": 4, "f16": 2, "bf16": 2, "i8": 1}
+
+
+def cache_sizes():
+    """Data cache sizes of cpu0 in bytes, e.g. {"L1d": 49152, "L2": ..., "L3": ...}."""
+    caches = {}
+    for index in glob.glob("/sys/devices/system/cpu/cpu0/cache/index*"):
+        try:
+            with open(os.path.join(index, "level")) as f:
+                level = f.read().strip()
+            with open(os.path.join(index, "type")) as f:
+                kind = f.read().strip()
+            with open(os.path.join(index, "size")) as f:
+                size = f.read().strip()
+        except OSError:
+            continue
+        if kind == "Instruction":
+            continue
+        scale = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}.get(size[-1:], 1)
+        name = "L1d" if level == "1" else "L" + level
+        caches[name] = int(size.rstrip("KMG")) * scale
+    return caches or dict(DEFAULT_CACHES)
+
+
+# -- Loop nests ---------------------------------------------------------------
+
+def walk_ops(op):
+    for region in op.regions:
+        for block in region:
+            for child in block:
+                yield child.operation
+                yield from walk_ops(child.operation)
+
+
+def _linear(expr):
+    """{dim: coefficient} of an affine expression, or None if it is not linear."""
+    from mlir.ir import AffineAddExpr, AffineConstantExpr, AffineDimExpr, AffineMulExpr
+
+    if AffineDimExpr.isinstance(expr):
+        return {AffineDimExpr(expr).position: 1}
+    if AffineConstantExpr.isinstance(expr):
+        return {}
+    if AffineAddExpr.isinstance(expr):
+        add = AffineAddExpr(expr)
+        lhs, rhs = _linear(add.lhs), _linear(add.rhs)
+        if lhs is None or rhs is None:
+            return None
+        for dim, coef in rhs.items():
+            lhs[dim] = lhs.get(dim, 0) + coef
+        return lhs
+    if AffineMulExpr.isinstance(expr):
+        mul = AffineMulExpr(expr)
+        for term, factor in ((mul.lhs, mul.rhs), (mul.rhs, mul.lhs)):
+            if AffineConstantExpr.isinstance(factor):
+                inner = _linear(term)
+                if inner is None:
+                    return None
+                value = AffineConstantExpr(factor).value
+                return {dim: coef * value for dim, coef in inner.items()}
+    return None
+
+
+def _describe(op):
+    """Plain-data description of a linalg.generic: loop ranges and operand accesses."""
+    from mlir.ir import AffineMapAttr, ShapedType
+
+    iterators = ["reduction" if "reduction" in str(it) else "parallel"
+                 for it in op.attributes["iterator_types"]]
+    operands = []
+    ranges = [None] * len(iterators)
+    for value, attr in zip(op.operands, op.attributes["indexing_maps"]):
+        shaped = ShapedType(value.type)
+        shape = list(shaped.shape)
+        index = []
+        for size, expr in zip(shape, AffineMapAttr(attr).value.results):
+            terms = _linear(expr)
+            index.append(None if terms is None else sorted(terms.items()))
+            if terms and len(terms) == 1 and list(terms.values()) == [1]:
+                dim = list(terms)[0]
+                if ranges[dim] is None:
+                    ranges[dim] = size
+        operands.append({"shape": shape, "index": index,
+                         "bytes": ELEMENT_BYTES.get(str(shaped.element_type), 4)})
+    return {"loops": ranges, "iterators": iterators, "operands": operands}
+
+
+def loop_nests(module):
+    """[(name, op, description)] of the conv and matmul nests, in program order."""
+    nests, layer = [], 0
+    for op in walk_ops(module.operation):
+        if op.name != "linalg.generic":
+            continue
+        desc = _describe(op)
+        reduced = {i for i, it in enumerate(desc["iterators"]) if it == "reduction"}
+        # A contraction reads two operands along its reduction loops (image and
+        # filter, activations and weights); a softmax sum reads one.  Pooling
+        # has two reduction loops and is left alone.
+        readers = sum(1 for operand in desc["operands"]
+                      if any(terms and reduced & {dim for dim, _ in terms}
+                             for terms in operand["index"]))
+        if readers < 2:
+            continue
+        # Convolutions with packed weights (weight_packing.py) split the
+        # input-channel loop in two.
+        if len(reduced) in (3, 4):
+            kind = "conv"
+        elif len(reduced) == 1:
+            kind = "fc"
+        else:
+            continue
+        if None in desc["loops"]:
+            continue
+        layer += 1
+        nests.append(("%s%d" % (kind, layer), op, desc))
+    return nests
+
+
+# -- Cache model ----------------------------------------------------------------
+
+def footprint(desc, tiles):
+    """Bytes touched by one tile; `tiles` gives the extent of every loop."""
+    total = 0
+    for operand in desc["operands"]:
+        elements = 1
+        for size, terms in zip(operand["shape"], operand["index"]):
+            if terms is None:
+                elements *= size
+            else:
+                elements *= min(size, sum(coef * (tiles[dim] - 1) for dim, coef in terms) + 1)
+        total += elements * operand["bytes"]
+    return total
+
+
+def _candidates(extent):
+    if extent <= 16:
+        return [extent]
+    sizes, size = [], 8
+    while size < extent:
+        sizes.append(size)
+        size *= 2
+    return sizes + [extent]
+
+
+def to_tile_sizes(desc, tiles):
+    """transform.structured tile sizes: 0 leaves a loop untiled."""
+    return [0 if tile >= extent else tile for tile, extent in zip(tiles, desc["loops"])]
+
+
+def model_tile_sizes(desc, budget):
+    """Tile with the most flops per byte whose footprint fits in `budget` bytes."""
+    best, best_key = None, None
+    for tiles in itertools.product(*[_candidates(n) for n in desc["loops"]]):
+        size = footprint(desc, tiles)
+        if size > budget:
+            continue
+        work = 1
+        for tile in tiles:
+            work *= tile
+        key = (work / size, work)
+        if best_key is None or key > best_key:
+            best, best_key = tiles, key
+    if best is None:
+        # Nothing fits: tile every loop as small as it gets.
+        best = [min(_candidates(n)) for n in desc["loops"]]
+    return to_tile_sizes(desc, best)
+
+
+# -- Applying a config ------------------------------------------------------------
+
+def tile_flag(config):
+    sizes = " ".join("%s=%s" % (name, ",".join(str(s) for s in nest["tile_sizes"]))
+                     for name, nest in sorted(config["nests"].items()))
+    return '--%s="%s"' % (TILE_PASS, sizes)
+
+
+def tile_stage_index(stages):
+    for i, stage in enumerate(stages):
+        if any(parse_pass_flag(p)[0] in LOWERING_PASSES for p in stage.passes):
+            return i
+    raise ValueError("no stage lowers linalg to loops; nowhere to tile")
+
+
+def with_tile_config(stages, config):
+    """Stage list with per-nest tiling in place of the fixed --affine-loop-tile."""
+    target = tile_stage_index(stages)
+    out = []
+    for i, stage in enumerate(stages):
+        passes = [p for p in stage.passes
+                  if parse_pass_flag(p)[0] not in ("affine-loop-tile", TILE_PASS)]
+        if i == target:
+            passes.insert(0, tile_flag(config))
+        out.append(stage._replace(passes=passes))
+    return out
+
+
+def transform_script(body):
+    """A transform module whose entry point runs `body` (lines using %root)."""
+    lines = ["module attributes {transform.with_named_sequence} {",
+             "  transform.named_sequence @__transform_main("
+             "%root: !transform.any_op {transform.readonly}) {"]
+    lines += ["    " + line for line in body]
+    lines += ["    transform.yield", "  }", "}"]
+    return "\n".join(lines)
+
+
+def apply_transform(module, body, tagged, tag=TAG):
+    """Tag ops ({name: op}) with `tag`, run the transform body, drop the tags.
+
+    The body finds its payload with
+    `transform.structured.match attributes {<tag> = "<name>"}`.
+    """
+    from mlir.dialects.transform import interpreter
+    from mlir.ir import Module, StringAttr
+
+    for name, op in tagged.items():
+        op.attributes[tag] = StringAttr.get(name)
+    script = Module.parse(transform_script(body))
+    entry = next(op for op in script.body.operations
+                 if op.operation.name == "transform.named_sequence")
+    interpreter.apply_named_sequence(module.operation, entry, script)
+    for op in walk_ops(module.operation):
+        if tag in op.attributes:
+            del op.attributes[tag]
+
+
+def match_tagged(handle, name, tag=TAG):
+    return ('%s = transform.structured.match attributes {%s = "%s"} in %%root '
+            ": (!transform.any_op) -> !transform.any_op" % (handle, tag, name))
+
+
+def _tile_body(sizes):
+    body = []
+    for n, (name, tile) in enumerate(sizes):
+        loops = sum(1 for s in tile if s)
+        if not loops:
+            continue
+        body.append(match_tagged("%%op%d" % n, name))
+        body.append("%%tiled%d, %%loops%d%s = transform.structured.tile_using_for %%op%d "
+                    "tile_sizes [%s] : (!transform.any_op) -> (%s)"
+                    % (n, n, ":%d" % loops if loops > 1 else "", n,
+                       ", ".join(str(s) for s in tile),
+                       ", ".join(["!transform.any_op"] * (loops + 1))))
+    return body
+
+
+def tile_pass(module, options):
+    """Driver implementation of --tile-loop-nests="conv1=0,16,... fc6=...": tile
+    each named nest with its own sizes."""
+    sizes = [(name, [int(s) for s in value.split(",")]) for name, value in options]
+    nests = {name: op for name, op, _ in loop_nests(module)}
+    missing = [name for name, _ in sizes if name not in nests]
+    if missing:
+        raise ValueError("no loop nest named %s in this module" % ", ".join(missing))
+    apply_transform(module, _tile_body(sizes), {name: nests[name] for name, _ in sizes})
+
+
+# -- Command line -------------------------------------------------------------------
+
+def discover(pipeline, input_ir):
+    """Descriptions of the nests as the tiling step will see them."""
+    from mlir.ir import Context
+    from phase_driver import load_module, run_passes
+
+    stages = PIPELINES[pipeline]
+    with Context():
+        module = load_module(input_ir)
+        for stage in stages[:tile_stage_index(stages)]:
+            run_passes(module, stage.passes)
+        return [(name, desc) for name, _, desc in loop_nests(module)]
+
+
+def model_config(pipeline, input_ir, level, fill):
+    caches = cache_sizes()
+    budget = int(caches.get(level, DEFAULT_CACHES.get(level, 1 << 20)) * fill)
+    config = {"pipeline": pipeline, "caches": caches, "level": level, "fill": fill,
+              "nests": {}}
+    for name, desc in discover(pipeline, input_ir):
+        config["nests"][name] = dict(desc, tile_sizes=model_tile_sizes(desc, budget),
+                                     source="model")
+    return config
+
+
+def neighbours(desc, sizes):
+    """Untiled, and each tiled loop halved and doubled."""
+    out = [[0] * len(sizes)]
+    for i, size in enumerate(sizes):
+        if not size:
+            continue
+        for factor in (0.5, 2):
+            tile = int(size * factor)
+            if 1 <= tile < desc["loops"][i]:
+                out.append(sizes[:i] + [tile] + sizes[i + 1:])
+    return out
+
+
+def sweep(config, pipeline, evaluator):
+    """Coordinate descent over nests; every other nest keeps its current sizes."""
+    stages, best_ms = PIPELINES[pipeline], None
+
+    def measure(label):
+        result = evaluator.evaluate(label, with_tile_config(stages, config), pipeline)
+        if result["status"] != "ok" or not result.get("latency_ms"):
+            print("  %s: %s" % (label, result["status"]))
+            return None
+        print("  %s: %.3f ms" % (label, result["latency_ms"]))
+        return result["latency_ms"]
+
+    best_ms = measure("tiles_model")
+    for name, nest in sorted(config["nests"].items()):
+        print("Sweeping %s (model: %s)" % (name, nest["tile_sizes"]))
+        chosen = nest["tile_sizes"]
+        for sizes in neighbours(nest, chosen):
+            nest["tile_sizes"] = sizes
+            ms = measure("tiles_%s_%s" % (name, "-".join(str(s) for s in sizes)))
+            if ms is not None and (best_ms is None or ms < best_ms):
+                best_ms, chosen = ms, sizes
+                nest["source"] = "sweep"
+        nest["tile_sizes"] = chosen
+    config["latency_ms"] = best_ms
+    return config
+
+
+def main():
+    from evaluate import add_evaluator_args, evaluator_from_args
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("caches", help="print the cache sizes the model uses")
+    for cmd in ("model", "sweep"):
+        p = sub.add_parser(cmd, help="write a config from the cache model" if cmd == "model"
+                           else "start from the model and benchmark neighbouring sizes")
+        p.add_argument("-p", "--pipeline", choices=sorted(PIPELINES), default="o1")
+        p.add_argument("-o", "--output", default="tiles.json")
+        p.add_argument("--level", default="L2", help="cache level a tile must fit in")
+        p.add_argument("--fill", type=float, default=0.5,
+                       help="fraction of that cache a tile may use")
+        if cmd == "sweep":
+            add_evaluator_args(p)
+        else:
+            p.add_argument("-i", "--input", default="alexnet_linalg.mlir")
+    args = parser.parse_args()
+
+    if args.cmd == "caches":
+        for name, size in sorted(cache_sizes().items()):
+            print("%-4s %8d KiB" % (name, size >> 10))
+        return 0
+
+    config = model_config(args.pipeline, args.input, args.level, args.fill)
+    if not config["nests"]:
+        sys.exit("no conv or matmul loop nests found in %s" % args.input)
+    if args.cmd == "sweep":
+        if not args.image:
+            parser.error("--image is required to benchmark tile sizes")
+        evaluator = evaluator_from_args(args)
+        evaluator.prepare()
+        sweep(config, args.pipeline, evaluator)
+    for name, nest in sorted(config["nests"].items()):
+        print("%-6s loops %-36s tiles %s (%s)" % (name, nest["loops"], nest["tile_sizes"],
+                                                  nest["source"]))
+    with open(args.output, "w") as f:
+        json.dump(config, f, indent=1)
+    print("Wrote %s" % args.output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+"""Compile-time packing of the conv and fc weights into blocked layouts.
+
+model.py exports dense OIHW (conv) and OI (fc) weights, and the lowered loops
+read them with large strides on every inference: the output channels of one
+filter tap are I*kh*kw floats apart.  --pack-weights, run after Stage 1 like
+the conv rewrites, replaces each layer with a linalg.generic that reads a
+packed copy of its weights instead:
+
+- convolutions: OIhw8i8o, i.e. [O/8][I/8][kh][kw][8i][8o].  The 8 output
+  channels of a tap (one ymm register) are contiguous, and the 8 input
+  channels that update them follow.  Blocks shrink to divide the channel
+  count, so conv1 (3 input channels) is OIhw8o.
+- fully-connected: panel-major, [N/16][K][16]: the K x 16 panel that a tile
+  of 16 outputs consumes is contiguous.  fc8 (1000 outputs) uses 8-wide
+  panels.
+
+The packed arrays are computed here, from the constant weights, and stored as
+dense_resource blobs.  The original constants become dead and are dropped,
+so nothing is repacked at runtime.  Layers are named as in conv_rewrite.py;
+the flag takes an optional layer list: --pack-weights="conv2 fc6 fc-panel=8".
+It runs after --im2col and --winograd, and the layers they rewrote are left
+alone.
+
+Usage:
+  python3 tools/phase_driver.py -p o1 --pack-weights
+  python3 tools/weight_packing.py layouts -p o1 -i alexnet_linalg.mlir
+"""
+
+import argparse
+import sys
+
+from conv_rewrite import CANONICALIZE, NHWC_CONV, PACK_PASS, named_layers
+from pipelines import PIPELINES, stage_label
+from tiling import apply_transform
+from weights import Weights, resource_constant
+
+TAG = "pack_weights"
+DEFAULT_CONV_BLOCK = 8
+DEFAULT_FC_PANEL = 16
+
+
+def block_size(extent, preferred):
+    """Largest power-of-two block up to `preferred` that divides `extent`."""
+    block = preferred
+    while extent % block:
+        block //= 2
+    return block
+
+
+def conv_layout(shape, block):
+    """(input block, output block, packed shape, name) of an OIHW filter."""
+    o, i, kh, kw = shape
+    ib, ob = block_size(i, block), block_size(o, block)
+    name = "OIhw" + ("%di" % ib if ib > 1 else "") + ("%do" % ob if ob > 1 else "")
+    return ib, ob, [o // ob, i // ib, kh, kw, ib, ob], name
+
+
+def fc_layout(shape, panel):
+    """(panel width, packed shape, name) of a K x N matmul operand."""
+    k, n = shape
+    width = block_size(n, panel)
+    return width, [n // width, k, width], "panel-major [N/%d][K][%d]" % (width, width)
+
+
+def pack_conv(weights, ib, ob):
+    o, i, kh, kw = weights.shape
+    return weights.reshape(o // ob, ob, i // ib, ib, kh, kw).transpose(0, 2, 4, 5, 3, 1)
+
+
+def pack_fc(weights, width):
+    k, n = weights.shape
+    return weights.reshape(k, n // width, width).transpose(1, 0, 2)
+
+
+def _contraction(result_type, inputs, init, maps, iterators):
+    """linalg.generic computing init += inputs[0] * inputs[1]."""
+    from mlir.dialects import arith, linalg
+    from mlir.ir import (AffineMapAttr, ArrayAttr, Attribute, F32Type, InsertionPoint)
+
+    f32 = F32Type.get()
+    op = linalg.GenericOp(
+        [result_type], inputs, [init],
+        ArrayAttr.get([AffineMapAttr.get(m) for m in maps]),
+        ArrayAttr.get([Attribute.parse("#linalg.iterator_type<%s>" % it) for it in iterators]))
+    block = op.regions[0].blocks.append(f32, f32, f32)
+    with InsertionPoint(block):
+        a, b, acc = block.arguments
+        linalg.YieldOp([arith.AddFOp(acc, arith.MulFOp(a, b).result).result])
+    return op
+
+
+def _packed_conv(op, weights, name, block):
+    """Generic over (n, fo, oh, ow, co, kh, kw, ci, fi) reading the packed filter."""
+    from mlir.ir import AffineDimExpr, AffineMap, DenseIntElementsAttr, F32Type, \
+        RankedTensorType
+
+    ib, ob, shape, _ = conv_layout(list(weights.shape), block)
+    sh, sw = [int(v) for v in DenseIntElementsAttr(op.attributes["strides"])]
+    dh, dw = [int(v) for v in DenseIntElementsAttr(op.attributes["dilations"])]
+    d = [AffineDimExpr.get(i) for i in range(9)]
+    n, fo, oh, ow, co, kh, kw, ci, fi = d
+    maps = [AffineMap.get(9, 0, [n, co * ib + ci, oh * sh + kh * dh, ow * sw + kw * dw]),
+            AffineMap.get(9, 0, [fo, co, kh, kw, ci, fi]),
+            AffineMap.get(9, 0, [n, fo * ob + fi, oh, ow])]
+    iterators = ["parallel"] * 4 + ["reduction"] * 4 + ["parallel"]
+    packed = resource_constant(pack_conv(weights, ib, ob), name + "_packed",
+                               RankedTensorType.get(shape, F32Type.get()))
+    return _contraction(op.results[0].type, [op.operands[0], packed.result],
+                        op.operands[2], maps, iterators)
+
+
+def _packed_fc(op, weights, name, panel):
+    """Generic over (m, no, k, ni) reading the panel-major weights."""
+    from mlir.ir import AffineDimExpr, AffineMap, F32Type, RankedTensorType
+
+    width, shape, _ = fc_layout(list(weights.shape), panel)
+    m, no, k, ni = [AffineDimExpr.get(i) for i in range(4)]
+    maps = [AffineMap.get(4, 0, [m, k]),
+            AffineMap.get(4, 0, [no, k, ni]),
+            AffineMap.get(4, 0, [m, no * width + ni])]
+    packed = resource_constant(pack_fc(weights, width), name + "_packed",
+                               RankedTensorType.get(shape, F32Type.get()))
+    return _contraction(op.results[0].type, [op.operands[0], packed.result],
+                        op.operands[2], maps, ["parallel", "parallel", "reduction", "parallel"])
+
+
+def plan(module, weights, names=None):
+    """[(name, op, weights)] of the layers to pack, with their constant weights."""
+    layers = named_layers(module)
+    known = {name for name, _ in layers}
+    missing = [name for name in names or [] if name not in known]
+    if missing:
+        raise ValueError("no layer named %s left in this module" % ", ".join(missing))
+    out = []
+    for name, op in layers:
+        if (names and name not in names) or op.name == NHWC_CONV:
+            continue
+        array = weights.source(op.operands[1])
+        if array is not None:
+            out.append((name, op, array))
+    return out
+
+
+def pack_pass(module, options):
+    """Driver implementation of --pack-weights."""
+    from mlir.ir import InsertionPoint
+
+    names = [key for key, value in options if value is None]
+    values = dict(options)
+    block = int(values.get("conv-block") or DEFAULT_CONV_BLOCK)
+    panel = int(values.get("fc-panel") or DEFAULT_FC_PANEL)
+    for name, op, array in plan(module, Weights(module), names):
+        with InsertionPoint(op), op.location:
+            if name.startswith("conv"):
+                packed = _packed_conv(op, array, name, block)
+            else:
+                packed = _packed_fc(op, array, name, panel)
+        op.results[0].replace_all_uses_with(packed.results[0])
+        op.erase()
+    # Drop the unpacked constants (and the fc transposes) right away.
+    apply_transform(module, CANONICALIZE, {}, TAG)
+
+
+# -- Command line -------------------------------------------------------------------
+
+def main():
+    from mlir.ir import Context
+    from phase_driver import load_module, run_passes
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("layouts", help="packed layout of every layer")
+    p.add_argument("-p", "--pipeline", choices=sorted(PIPELINES), default="o1")
+    p.add_argument("-i", "--input", default="alexnet_linalg.mlir")
+    p.add_argument("--conv-block", type=int, default=DEFAULT_CONV_BLOCK)
+    p.add_argument("--fc-panel", type=int, default=DEFAULT_FC_PANEL)
+    args = parser.parse_args()
+
+    stages = PIPELINES[args.pipeline]
+    with Context():
+        module = load_module(args.input)
+        for stage in stages:
+            run_passes(module, stage.passes)
+            if stage_label(stage) == "1":
+                break
+        print("%-6s %-20s %-36s %s" % ("layer", "weights", "layout", "packed"))
+        for name, op, array in plan(module, Weights(module)):
+            if name.startswith("conv"):
+                shape, layout = conv_layout(list(array.shape), args.conv_block)[2:]
+            else:
+                shape, layout = fc_layout(list(array.shape), args.fc_panel)[1:]
+            print("%-6s %-20s %-36s %s" % (name, "x".join(map(str, array.shape)), layout,
+                                           "x".join(map(str, shape))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,270 @@
+#!/usr/bin/env python3
+"""Reading and replacing the weight constants of the AlexNet module.
+
+torch-mlir exports every parameter as an arith.constant holding a
+dense_resource blob.  The driver-side steps that transform weights at compile
+time (conv_rewrite.py, weight_packing.py) read them through Weights and put
+the result back with resource_constant().
+
+`externalize` moves the weights out of the IR instead.  Each weight is
+written to one binary file at a 64-byte aligned offset.  The IR then reads it
+through a view of a single external symbol, declared as
+`memref.global constant @alexnet_weights : memref<Nxi8>`.  It reaches LLVM
+IR as one `external constant` declaration, so mlir-translate, opt and llc
+never see the weight values.  The symbol is defined at link time by one of
+the two files written next to the binary file:
+
+- alexnet_weights.s reserves a page-aligned .bss block, and the benchmark
+  driver maps the file over it at startup;
+- alexnet_weights_embed.s pulls the file into .rodata with .incbin, so the
+  weights are in the executable as with the inline constants.
+
+Usage:
+  python3 tools/weights.py externalize -i alexnet_linalg.mlir \
+      -o alexnet_linalg_ext.mlir --blob alexnet_weights.bin
+"""
+
+import argparse
+import json
+import os
+import sys
+
+from tiling import walk_ops
+
+RESOURCE_ALIGNMENT = 64
+BLOB_SYMBOL = "alexnet_weights"
+# Weights are aligned for AVX-512 loads; the mapping for 2 MB pages.
+BLOB_ALIGNMENT = 64
+MAP_ALIGNMENT = 2 << 20
+# Smaller constants (scalars, shape tensors) stay in the IR.
+MIN_EXTERNAL_ELEMENTS = 1024
+
+
+def resource_blobs(module):
+    """{key: raw bytes} of the module's dense_resource blobs.
+
+    The bindings cannot read a blob back, so the module is printed once and
+    the hex blobs are taken from its dialect_resources section.
+    """
+    import tempfile
+
+    blobs = {}
+    with tempfile.TemporaryFile("w+") as f:
+        module.operation.print(file=f)
+        f.seek(0)
+        in_resources = False
+        for line in f:
+            if line.startswith("{-#"):
+                in_resources = True
+            elif in_resources and ":" in line and '"0x' in line:
+                key, value = line.split(":", 1)
+                blobs[key.strip()] = bytes.fromhex(value.strip().strip(",").strip('"')[2:])
+    return blobs
+
+
+def is_constant(value):
+    owner = value.owner
+    return hasattr(owner, "name") and owner.name == "arith.constant"
+
+
+def _transpose_permutation(op):
+    """Permutation of a linalg.transpose, or of a generic that only transposes."""
+    from mlir.ir import AffineDimExpr, AffineMapAttr, DenseI64ArrayAttr
+
+    if op.name == "linalg.transpose":
+        return list(DenseI64ArrayAttr(op.attributes["permutation"]))
+    if op.name != "linalg.generic" or len(op.operands) != 2:
+        return None
+    body = list(op.regions[0].blocks[0])
+    if len(body) != 1 or body[0].operands[0] != op.regions[0].blocks[0].arguments[0]:
+        return None
+    maps = [AffineMapAttr(attr).value for attr in op.attributes["indexing_maps"]]
+    if not all(AffineDimExpr.isinstance(e) for m in maps for e in m.results):
+        return None
+    src = [AffineDimExpr(e).position for e in maps[0].results]
+    dst = [AffineDimExpr(e).position for e in maps[1].results]
+    if sorted(src) != list(range(len(src))) or dst != list(range(len(dst))):
+        return None
+    # out[d0, d1, ...] = in[src...]: output dim i reads input dim src.index(i).
+    return [src.index(i) for i in range(len(src))]
+
+
+class Weights:
+    """f32 values of the weight constants of one module, as numpy arrays."""
+
+    def __init__(self, module):
+        self.module = module
+        self._blobs = None
+
+    def blobs(self):
+        # Printing the module to read the blobs is slow; do it once.
+        if self._blobs is None:
+            self._blobs = resource_blobs(self.module)
+        return self._blobs
+
+    def array(self, value):
+        """Contents of an arith.constant result, in the shape of its tensor."""
+        import numpy as np
+        from mlir.ir import DenseElementsAttr, DenseResourceElementsAttr, ShapedType
+
+        attr = value.owner.attributes["value"]
+        shape = ShapedType(value.type).shape
+        if DenseResourceElementsAttr.isinstance(attr):
+            key = str(attr).split("<", 1)[1].split(">", 1)[0]
+            # The first four bytes of a blob hold its alignment.
+            return np.frombuffer(self.blobs()[key][4:], dtype=np.float32).reshape(shape)
+        return np.array(DenseElementsAttr(attr)).reshape(shape)
+
+    def source(self, value):
+        """Contents of `value` if it is a constant, or a transpose of one.
+
+        torch-mlir lowers nn.Linear to a matmul with the transposed weight
+        matrix, which Stage 1 does not fold into the constant.
+        """
+        if is_constant(value):
+            return self.array(value)
+        op = value.owner
+        if not hasattr(op, "name"):
+            return None
+        perm = _transpose_permutation(op)
+        if perm is None or not is_constant(op.operands[0]):
+            return None
+        return self.array(op.operands[0]).transpose(perm)
+
+
+def resource_constant(array, name, ty):
+    """An arith.constant of `array` (f32) stored as a dense_resource blob,
+    built at the current insertion point."""
+    import numpy as np
+    from mlir.dialects import arith
+    from mlir.ir import DenseResourceElementsAttr
+
+    array = np.ascontiguousarray(array, dtype=np.float32)
+    return arith.ConstantOp(ty, DenseResourceElementsAttr.get_from_buffer(
+        array, name, ty, alignment=RESOURCE_ALIGNMENT))
+
+
+# -- External weight file -----------------------------------------------------
+
+def _external_constants(module):
+    """The f32 arith.constant ops worth moving out of the IR."""
+    from mlir.ir import F32Type, ShapedType
+
+    out = []
+    for op in walk_ops(module.operation):
+        if op.name != "arith.constant" or not ShapedType.isinstance(op.results[0].type):
+            continue
+        shaped = ShapedType(op.results[0].type)
+        if (shaped.has_static_shape and F32Type.isinstance(shaped.element_type)
+                and shaped.get_number_of_elements() >= MIN_EXTERNAL_ELEMENTS):
+            out.append(op)
+    return out
+
+
+def reservation_asm(size):
+    """Assembly for the .bss block the benchmark driver maps the weights over."""
+    reserved = -(-size // MAP_ALIGNMENT) * MAP_ALIGNMENT
+    return "\n".join([
+        "# Generated by tools/weights.py externalize: %d bytes of weights." % size,
+        '.section .bss.%s,"aw",@nobits' % BLOB_SYMBOL,
+        ".p2align %d" % (MAP_ALIGNMENT.bit_length() - 1),
+        ".globl %s" % BLOB_SYMBOL,
+        "%s:" % BLOB_SYMBOL,
+        ".zero %d" % reserved,
+        '.section .rodata.%s,"a",@progbits' % BLOB_SYMBOL,
+        ".p2align 3",
+        ".globl %s_size" % BLOB_SYMBOL,
+        "%s_size:" % BLOB_SYMBOL,
+        ".quad %d" % size,
+        ".globl %s_reserved" % BLOB_SYMBOL,
+        "%s_reserved:" % BLOB_SYMBOL,
+        ".byte 1",
+        '.section .note.GNU-stack,"",@progbits',
+        ""])
+
+
+def embed_asm(blob_path, size):
+    """Assembly that defines the weight symbol with the contents of the file."""
+    return "\n".join([
+        "# Generated by tools/weights.py externalize: %d bytes of weights." % size,
+        '.section .rodata.%s,"a",@progbits' % BLOB_SYMBOL,
+        ".p2align %d" % (BLOB_ALIGNMENT.bit_length() - 1),
+        ".globl %s" % BLOB_SYMBOL,
+        "%s:" % BLOB_SYMBOL,
+        '.incbin "%s"' % os.path.abspath(blob_path),
+        ".p2align 3",
+        ".globl %s_size" % BLOB_SYMBOL,
+        "%s_size:" % BLOB_SYMBOL,
+        ".quad %d" % size,
+        '.section .note.GNU-stack,"",@progbits',
+        ""])
+
+
+def externalize(module, blob_path):
+    """Move the weights of `module` to `blob_path`; returns the manifest."""
+    import numpy as np
+    from mlir.dialects import arith, bufferization, memref
+    from mlir.ir import (IndexType, InsertionPoint, IntegerType, MemRefType, RankedTensorType,
+                         ShapedType, TypeAttr)
+
+    weights = Weights(module)
+    ops = _external_constants(module)
+    manifest, offset = [], 0
+    with open(blob_path, "wb") as f:
+        for n, op in enumerate(ops):
+            array = np.ascontiguousarray(weights.array(op.results[0]), dtype=np.float32)
+            offset = -(-offset // BLOB_ALIGNMENT) * BLOB_ALIGNMENT
+            f.seek(offset)
+            f.write(array.tobytes())
+            manifest.append({"index": n, "offset": offset, "shape": list(array.shape)})
+            offset += array.nbytes
+    i8 = IntegerType.get_signless(8)
+    blob_type = MemRefType.get([offset], i8)
+    with InsertionPoint.at_block_begin(module.body), module.operation.location:
+        memref.GlobalOp(sym_name=BLOB_SYMBOL, type_=TypeAttr.get(blob_type), constant=True)
+    for op, entry in zip(ops, manifest):
+        shaped = ShapedType(op.results[0].type)
+        view_type = MemRefType.get(shaped.shape, shaped.element_type)
+        with InsertionPoint(op), op.location:
+            blob = memref.GetGlobalOp(blob_type, BLOB_SYMBOL)
+            shift = arith.ConstantOp(IndexType.get(), entry["offset"])
+            view = memref.ViewOp(view_type, blob.result, shift.result, [])
+            tensor = bufferization.ToTensorOp(
+                RankedTensorType.get(shaped.shape, shaped.element_type), view.result,
+                restrict=True)
+        op.results[0].replace_all_uses_with(tensor.result)
+        op.erase()
+    return {"symbol": BLOB_SYMBOL, "size": offset, "weights": manifest}
+
+
+def main():
+    from mlir.ir import Context
+    from phase_driver import load_module, write_module
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("externalize", help="move the weights to a separate binary file")
+    p.add_argument("-i", "--input", default="alexnet_linalg.mlir")
+    p.add_argument("-o", "--output", default="alexnet_linalg_ext.mlir",
+                   help="IR without the weights (.mlirbc for bytecode)")
+    p.add_argument("--blob", default=BLOB_SYMBOL + ".bin")
+    args = parser.parse_args()
+
+    with Context():
+        module = load_module(args.input)
+        info = externalize(module, args.blob)
+        write_module(module, args.output)
+    base = os.path.splitext(args.blob)[0]
+    with open(base + ".s", "w") as f:
+        f.write(reservation_asm(info["size"]))
+    with open(base + "_embed.s", "w") as f:
+        f.write(embed_asm(args.blob, info["size"]))
+    with open(base + ".json", "w") as f:
+        json.dump(info, f, indent=1)
+    print("Wrote %s (%d weights, %.1f MB), %s, %s.s and %s_embed.s" % (
+        args.blob, len(info["weights"]), info["size"] / 2.0 ** 20, args.output, base, base))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())